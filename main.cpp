@@ -11,14 +11,33 @@
 
 #define SCR_WIDTH 800
 #define SCR_HEIGHT 800
+#define RENDER_SCALE 0.5f // resolution of the scene and cloud buffers relative to the window, upscaled by Screen::drawScreen
+#define CLOUD_PIXEL_BUDGET 640000 // the cloud pass never renders more pixels than this, whatever the window size
+
+#define PROP_COUNT 256
+
+#define BRICK_VOLUME_PATH "clouds.bricks" // the density is exported to and imported from this file
+#define OUT_OF_CORE_SIZE 1032 // of the offline volume baked slab by slab - a multiple of the bricks and of the cells of the base octave
+#define OUT_OF_CORE_PATH "clouds_offline.bricks"
+
+#define CARVE_DISTANCE 0.3f // of the hole carved in front of the camera
+#define CARVE_RADIUS 0.06f
+
+#define REFERENCE_PATH "screenshots/reference" // the reference render and the volume and frame it was rendered from
 
 #include <iostream>
+#include <random>
+#include <string>
+#include <chrono>
+#include <cstdlib>
 
 // include OpenGL libraries
 #include <GL/glew.h>
 #define GLFW_COCOA_GRAPHICS_SWITCHING 0x00023003
 #include <GLFW/glfw3.h>
+#ifdef __APPLE__
 #include <OpenGL/OpenGL.h>
+#endif
 #include "glm.hpp"
 #include "gtc/matrix_transform.hpp"
 #include "gtc/type_ptr.hpp"
@@ -27,11 +46,20 @@
 #include "screen.h"
 #include "camera.h"
 #include "compute_kernel.h"
+#include "sky_capture.h"
+#include "frame_uniforms.h"
+#include "file_watcher.h"
+#include "thread_pool.h"
+#include "simulation.h"
 
 
 // function declarations
 void framebufferSizeCallback(GLFWwindow*, int, int);
 void processInput(GLFWwindow*);
+void renderReference(int, int);
+int renderOffline(int, const char*[]);
+void carveClouds();
+void toggleFullscreen(GLFWwindow*);
 void mouseCallback(GLFWwindow*, double, double);
 void mouseButtonCallback(GLFWwindow*, int, int, int);
 void scrollCallback(GLFWwindow*, double, double);
@@ -71,12 +99,39 @@ int fps_steps_counter = 0;
 // screenshot variable
 bool taking_screenshot = false;
 
-// camera pointer
-Camera* camera_ptr;
+// reference render variable
+bool rendering_reference = false;
+
+// brick volume variables
+bool exporting_bricks = false;
+bool importing_bricks = false;
+bool baking_offline = false;
+bool loading_offline = false;
+
+// density edit variable
+bool carving_clouds = false;
+
+// upscaler switch variable
+bool switching_upscaler = false;
+
+// fullscreen variables - the windowed position and size are restored when leaving the fullscreen
+bool switching_fullscreen = false;
+int windowed_x, windowed_y, windowed_width, windowed_height;
+
+// simulation pointer - the camera and the light are moved on its thread
+Simulation* simulation_ptr;
 
 // screen pointer
 Screen* screen_ptr;
 
+// clouds pointer
+Clouds* clouds_ptr;
+
+// the CPU reference of the current frame is rendered on this pool
+ThreadPool* pool_ptr;
+
+// frame data of the last rendered frame
+FrameData* frame_data_ptr;
 
 void processTime(float time) {
     delta_time = time - last_frame_time;
@@ -101,6 +156,9 @@ struct GLRendererInfo {
 
 
 int main(int argc, const char* argv[]) {
+    // the CPU reference of a saved frame needs neither a window nor a GPU
+    if(argc > 1 && std::string(argv[1]) == "--reference") return renderOffline(argc, argv);
+    
     // initialize GLFW
     glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
@@ -166,21 +224,50 @@ int main(int argc, const char* argv[]) {
         return -1;
     }
     
-    Shader shader("src/shaders/screen_clouds.vs", "src/shaders/clouds_fast.fs");
+    // per-frame data shared by all the shaders
+    FrameUniforms frame;
+    frame_data_ptr = &frame.data;
+    
+    Shader shader("src/shaders/clouds/screen_clouds.vs", "src/shaders/clouds/clouds_fast.fs", nullptr, cloudShaderDefines());
     
-    Screen screen("src/shaders/screen.vs", "src/shaders/screen.fs", SCR_WIDTH, SCR_HEIGHT);
+    Screen screen("src/shaders/screen/screen.vs", "src/shaders/screen/screen.fs", shader, scr_width, scr_height, RENDER_SCALE, CLOUD_PIXEL_BUDGET);
     screen_ptr = &screen;
     
-    Camera camera(60.0f, glm::vec3(0.5, 0.5, -2));
-    camera_ptr = &camera;
+    // the input moves this camera on the simulation thread, every frame renders a copy of its latest state
+    Simulation simulation(Camera(60.0f, glm::vec3(0.5, 0.5, -2)));
+    simulation_ptr = &simulation;
+    
+    // the model is parsed and decoded on the workers while the cloud volumes are generated
+    ThreadPool pool;
+    pool_ptr = &pool;
+    Object hand("assets/hand/hand.obj", "src/shaders/object/object.vs", "src/shaders/object/object.fs", &pool);
+    
+    // props scattered on a plane just below the cloud box
+    InstancedObject props("assets/die/die.obj", "src/shaders/object/object_instanced.vs", "src/shaders/object/object.fs", &pool);
+    std::mt19937 prop_rng(7);
+    std::uniform_real_distribution<float> prop_pos(-1.0f, 2.0f), prop_angle(0.0f, 6.2832f);
+    for(int i = 0; i < PROP_COUNT; i++) {
+        glm::mat4 M = glm::translate(glm::mat4(1.0f), glm::vec3(prop_pos(prop_rng), -0.05f, prop_pos(prop_rng)));
+        M = glm::rotate(M, prop_angle(prop_rng), glm::vec3(0.0f, 1.0f, 0.0f));
+        props.addInstance(glm::scale(M, glm::vec3(0.02f)));
+    }
+    std::vector<InstancedObject*> instanced_objects = {&props};
     
     Clouds clouds(shader);
-
-    clouds.transferData();
+    clouds_ptr = &clouds;
+    
+    // the objects are lit by a cubemap of the clouds around the camera
+    SkyCapture sky("src/shaders/clouds/screen_clouds.vs", "src/shaders/sky/irradiance.fs", shader);
+    
+    // shaders and kernels are reloaded as soon as they are saved
+    FileWatcher watcher;
+    for(const char* path : {"src/shaders/clouds/screen_clouds.vs", "src/shaders/clouds/clouds_fast.fs", "src/shaders/screen/screen.vs", "src/shaders/screen/screen.fs", "src/shaders/sky/irradiance.fs", CHANNELS_KERNEL_PATH, DENSITY_KERNEL_PATH, COVERAGE_KERNEL_PATH}) watcher.watch(path);
     
     //glEnable(GL_BLEND);
     //glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     
+    simulation.start();
+    
     while(!glfwWindowShouldClose(window)) {
         #ifdef __APPLE__
         macWindowFix(window);
@@ -191,43 +278,214 @@ int main(int argc, const char* argv[]) {
         
         processInput(window);
         
+        screen.applyPendingResize();
+        
+        for(const std::string& path : watcher.poll()) {
+            if(shader.usesFile(path) && shader.reload()) {
+                clouds.locateUniforms(shader);
+                screen.locateUniforms(shader);
+                sky.locateUniforms(shader);
+            }
+            screen.reloadShaders(path);
+            sky.reloadShaders(path);
+            if(clouds.usesFile(path)) clouds.reloadKernels(path);
+        }
+        
+        // everything below uses one consistent tick, however long the frame takes
+        const FrameSnapshot snapshot = simulation.latest();
+        Camera camera = snapshot.camera;
+        
+        clouds.setLightAngle(snapshot.light_angle);
+        clouds.updateLight();
+        clouds.updateShadow();
+        clouds.bindShadow();
+        
+        camera.transferData(frame.data);
+        clouds.transferData(frame.data);
+        frame.data.time = (float)snapshot.time;
+        frame.update();
+        
         shader.use();
+        clouds.transferData(shader);
         
-        camera.transferData(shader);
+        // one face of the sky cubemap per frame, with the cloud volumes bound above
+        sky.update(frame, shader);
+        sky.bind();
         
-        shader.setFloat("time", currentFrameTime);
+        hand.update((float)snapshot.time);
         
-        screen.drawToBuffer(shader);
+        screen.clearScene();
+        screen.drawObject(hand, camera);
+        screen.drawObjects(instanced_objects, camera);
+        screen.drawClouds(shader);
         screen.drawScreen(shader, scr_width, scr_height);
         
         glfwSwapBuffers(window);
         glfwPollEvents();
     }
     
+    simulation.stop();
     glfwTerminate();
     return 0;
 }
 
 void framebufferSizeCallback(GLFWwindow* window, int width, int height) {
+    if(width == 0 || height == 0) return; // minimised
     glViewport(0, 0, width, height);
     scr_width = width;
     scr_height = height;
     scr_ratio = (float)width/(float)height;
     
-    camera_ptr->setSize(scr_ratio);
+    if(simulation_ptr) simulation_ptr->setAspect(scr_ratio);
+    if(screen_ptr) screen_ptr->requestResize(width, height);
+}
+
+void toggleFullscreen(GLFWwindow* window) {
+    GLFWmonitor* monitor = glfwGetWindowMonitor(window);
+    if(monitor == NULL) {
+        glfwGetWindowPos(window, &windowed_x, &windowed_y);
+        glfwGetWindowSize(window, &windowed_width, &windowed_height);
+        
+        monitor = glfwGetPrimaryMonitor();
+        const GLFWvidmode* mode = glfwGetVideoMode(monitor);
+        glfwSetWindowMonitor(window, monitor, 0, 0, mode->width, mode->height, mode->refreshRate);
+    } else {
+        glfwSetWindowMonitor(window, NULL, windowed_x, windowed_y, windowed_width, windowed_height, GLFW_DONT_CARE);
+    }
+}
+
+// render the clouds of the last frame on the CPU, to compare with the GPU screenshot - the volume and the frame are saved too,
+// so that the same image can be rendered again with --reference on a machine without a GPU
+void renderReference(int width, int height) {
+    CloudVolume volume;
+    clouds_ptr->readVolume(volume);
+    volume.save(REFERENCE_PATH ".volume");
+    saveFrameData(REFERENCE_PATH ".frame", *frame_data_ptr);
+    
+    CloudRaymarcher raymarcher(volume, pool_ptr);
+    double start = glfwGetTime();
+    if(raymarcher.render(*frame_data_ptr, width, height) && raymarcher.saveTGA(REFERENCE_PATH ".tga")) {
+        std::cout << "CPU reference: " << width << "x" << height << " in " << (glfwGetTime() - start) * 1000.0 << " ms" << std::endl;
+    }
+}
+
+// Clouds --reference <volume> <frame> <width> <height> <image.tga> - the files saved by renderReference
+int renderOffline(int argc, const char* argv[]) {
+    int width = argc == 7 ? std::atoi(argv[4]) : 0;
+    int height = argc == 7 ? std::atoi(argv[5]) : 0;
+    if(width <= 0 || height <= 0) {
+        std::cerr << "ERROR: USAGE: " << argv[0] << " --reference <volume> <frame> <width> <height> <image.tga>" << std::endl;
+        return -1;
+    }
+    
+    CloudVolume volume;
+    FrameData frame;
+    if(!volume.load(argv[2]) || !loadFrameData(argv[3], frame)) return -1;
+    
+    ThreadPool pool;
+    CloudRaymarcher raymarcher(volume, &pool);
+    auto start = std::chrono::steady_clock::now();
+    if(!raymarcher.render(frame, width, height) || !raymarcher.saveTGA(argv[6])) return -1;
+    
+    std::cout << "CPU reference: " << width << "x" << height << " in " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+    return 0;
+}
+
+// carve a hole into the clouds in front of the camera - the clouds move through the box, so the point is moved into the density
+void carveClouds() {
+    const FrameData& frame = *frame_data_ptr;
+    glm::vec3 forward = glm::normalize(frame.camera_llc + 0.5f*frame.horizontal + 0.5f*frame.vertical);
+    glm::vec3 point = frame.origin + forward * CARVE_DISTANCE + frame.cloud_velocity * frame.time;
+    
+    DensityBrush brush;
+    brush.center = glm::vec3(glm::fract(point.x), point.y, glm::fract(point.z));
+    brush.extent = glm::vec3(CARVE_RADIUS);
+    brush.amount = -1.0f;
+    brush.noise = 0.5f;
+    clouds_ptr->editDensity(brush);
 }
 
 void processInput(GLFWwindow* window) {
     if(glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) glfwSetWindowShouldClose(window, true);
-    if(glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) camera_ptr->move(FORWARD, delta_time);
-    if(glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) camera_ptr->move(BACK, delta_time);
-    if(glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) camera_ptr->move(LEFT, delta_time);
-    if(glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) camera_ptr->move(RIGHT, delta_time);
     
-    if(glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS) camera_ptr->setFasterSpeed(true);
-    else if(glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_RELEASE) camera_ptr->setFasterSpeed(false);
-    if(glfwGetKey(window, GLFW_KEY_LEFT_CONTROL) == GLFW_PRESS) camera_ptr->setSlowerSpeed(true);
-    else if(glfwGetKey(window, GLFW_KEY_LEFT_CONTROL) == GLFW_RELEASE && glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_RELEASE) camera_ptr->setSlowerSpeed(false);
+    // GLFW can only be queried on the main thread, the simulation thread applies the held keys at its own tick
+    unsigned int keys = 0;
+    if(glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) keys |= INPUT_FORWARD;
+    if(glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) keys |= INPUT_BACK;
+    if(glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) keys |= INPUT_LEFT;
+    if(glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) keys |= INPUT_RIGHT;
+    if(glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS) keys |= INPUT_FAST;
+    if(glfwGetKey(window, GLFW_KEY_LEFT_CONTROL) == GLFW_PRESS) keys |= INPUT_SLOW;
+    if(glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS) keys |= INPUT_LIGHT_UP;
+    if(glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS) keys |= INPUT_LIGHT_DOWN;
+    simulation_ptr->setKeys(keys);
+    
+    if(glfwGetKey(window, GLFW_KEY_F) == GLFW_PRESS) {
+        if(!switching_fullscreen) toggleFullscreen(window);
+        switching_fullscreen = true;
+    } else if(glfwGetKey(window, GLFW_KEY_F) == GLFW_RELEASE) {
+        switching_fullscreen = false;
+    }
+    
+    if(glfwGetKey(window, GLFW_KEY_U) == GLFW_PRESS) {
+        if(!switching_upscaler) screen_ptr->cycleUpscaler();
+        switching_upscaler = true;
+    } else if(glfwGetKey(window, GLFW_KEY_U) == GLFW_RELEASE) {
+        switching_upscaler = false;
+    }
+    
+    if(glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS) {
+        if(!rendering_reference) renderReference(screen_ptr->internalWidth(), screen_ptr->internalHeight());
+        rendering_reference = true;
+    } else if(glfwGetKey(window, GLFW_KEY_R) == GLFW_RELEASE) {
+        rendering_reference = false;
+    }
+    
+    if(glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS) {
+        if(!exporting_bricks) {
+            BrickVolume volume;
+            clouds_ptr->exportBricks(volume);
+            if(volume.save(BRICK_VOLUME_PATH)) std::cout << "Exported " << volume.brickCount() << " bricks to " << BRICK_VOLUME_PATH << " (" << volume.bytes()/1024 << " KB)" << std::endl;
+        }
+        exporting_bricks = true;
+    } else if(glfwGetKey(window, GLFW_KEY_E) == GLFW_RELEASE) {
+        exporting_bricks = false;
+    }
+    
+    if(glfwGetKey(window, GLFW_KEY_I) == GLFW_PRESS) {
+        if(!importing_bricks) {
+            BrickVolume volume;
+            if(volume.load(BRICK_VOLUME_PATH)) clouds_ptr->importBricks(volume);
+        }
+        importing_bricks = true;
+    } else if(glfwGetKey(window, GLFW_KEY_I) == GLFW_RELEASE) {
+        importing_bricks = false;
+    }
+    
+    if(glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS) {
+        if(!baking_offline) clouds_ptr->bakeOutOfCore(OUT_OF_CORE_SIZE, OUT_OF_CORE_PATH);
+        baking_offline = true;
+    } else if(glfwGetKey(window, GLFW_KEY_O) == GLFW_RELEASE) {
+        baking_offline = false;
+    }
+    
+    // the offline volume is read through the mapping of the file, it does not have to fit into the memory
+    if(glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS) {
+        if(!loading_offline) {
+            MappedBrickVolume volume;
+            if(volume.open(OUT_OF_CORE_PATH)) clouds_ptr->importBricks(volume);
+        }
+        loading_offline = true;
+    } else if(glfwGetKey(window, GLFW_KEY_L) == GLFW_RELEASE) {
+        loading_offline = false;
+    }
+    
+    if(glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS) {
+        if(!carving_clouds) carveClouds();
+        carving_clouds = true;
+    } else if(glfwGetKey(window, GLFW_KEY_C) == GLFW_RELEASE) {
+        carving_clouds = false;
+    }
     
     if(glfwGetKey(window, GLFW_KEY_ENTER) == GLFW_PRESS) {
         if(!taking_screenshot) screen_ptr->takeScreenshot(scr_width, scr_height);
@@ -250,7 +508,7 @@ void mouseCallback(GLFWwindow* window, double x_pos, double y_pos) {
     mouse_last_x = x_pos;
     mouse_last_y = y_pos;
     
-    if(mouse_hidden) camera_ptr->rotate(offset_x, offset_y);
+    if(mouse_hidden) simulation_ptr->addMouseMotion(offset_x, offset_y);
 }
 
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
@@ -265,7 +523,7 @@ void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
 }
 
 void scrollCallback(GLFWwindow* window, double offset_x, double offset_y) {
-    camera_ptr->zoom(offset_y);
+    simulation_ptr->addScroll(offset_y);
 }
 
 
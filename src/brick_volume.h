@@ -0,0 +1,379 @@
+//
+//  brick_volume.h
+//  Clouds
+//
+//  Sparse density volume: the volume is split into BRICK_SIZE^3 bricks and only the bricks with any
+//  density are stored. The same bricks, with a one voxel apron for the filtering, fill the atlas texture
+//  the cloud shader samples through the brick index.
+//
+//  File layout (little endian):
+//      BrickVolumeHeader
+//      uint32 index[bricks^3]                  - x varies the fastest, the number of the stored brick or BRICK_EMPTY
+//      uint16 data[brick_count][BRICK_SIZE^3]  - IEEE 754 half floats, x varies the fastest inside a brick
+//
+//  Volumes larger than the memory are written slab by slab with BrickVolumeWriter and read brick by brick
+//  with MappedBrickVolume.
+//
+
+#ifndef brick_volume_h
+#define brick_volume_h
+
+#define BRICK_SIZE 8
+#define BRICK_APRON_SIZE (BRICK_SIZE+2) // a brick in the atlas, with the voxels of its neighbours around it
+#define BRICK_EMPTY 0xFFFFFFFFu
+#define BRICK_ATLAS_WIDTH 32 // bricks along x and y of the atlas, it grows along z
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+
+#include "mapped_file.h"
+
+struct BrickVolumeHeader {
+    char magic[4] = {'C', 'L', 'B', 'V'};
+    uint32_t version = 1;
+    uint32_t size = 0;        // voxels along each axis of the dense volume
+    uint32_t brick_size = BRICK_SIZE;
+    uint32_t brick_count = 0; // stored bricks
+};
+
+inline float halfToFloat(uint16_t h) {
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    float value;
+    if(exponent == 0) value = std::ldexp(float(mantissa), -24);
+    else if(exponent == 31) value = mantissa != 0 ? NAN : INFINITY;
+    else value = std::ldexp(float(mantissa | 0x400), int(exponent) - 25);
+    return (h & 0x8000) ? -value : value;
+}
+
+// rounds to the nearest half, ties away from zero
+inline uint16_t floatToHalf(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = uint16_t((bits >> 16) & 0x8000);
+    uint32_t mantissa = bits & 0x7fffff;
+    if(((bits >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0);
+
+    int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+    if(exponent >= 31) return sign | 0x7c00;
+    if(exponent <= 0) {
+        // subnormal or zero
+        if(exponent < -10) return sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        return sign | uint16_t((mantissa >> shift) + ((mantissa >> (shift-1)) & 1));
+    }
+    // a carry of the rounding moves into the exponent
+    return sign | uint16_t(((uint32_t(exponent) << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1));
+}
+
+class BrickVolume {
+public:
+    int size = 0;
+    int bricks = 0; // along each axis
+    std::vector<uint32_t> index;
+    std::vector<uint16_t> data;
+
+    static const int brick_voxels = BRICK_SIZE*BRICK_SIZE*BRICK_SIZE;
+
+    BrickVolume() {}
+
+    BrickVolume(int size) : size(size), bricks(size / BRICK_SIZE), index(size_t(bricks)*bricks*bricks, BRICK_EMPTY) {}
+
+    size_t brickCount() const {
+        return data.size() / brick_voxels;
+    }
+
+    // of the stored bricks and the index
+    size_t bytes() const {
+        return index.size()*sizeof(uint32_t) + data.size()*sizeof(uint16_t);
+    }
+
+    // position of a stored brick in the atlas, in bricks
+    static void atlasPosition(size_t brick, int& x, int& y, int& z) {
+        x = int(brick % BRICK_ATLAS_WIDTH);
+        y = int(brick / BRICK_ATLAS_WIDTH % BRICK_ATLAS_WIDTH);
+        z = int(brick / (BRICK_ATLAS_WIDTH*BRICK_ATLAS_WIDTH));
+    }
+
+    // size of the atlas holding brick_count bricks, in voxels
+    static void atlasSize(size_t brick_count, size_t& width, size_t& height, size_t& depth) {
+        size_t layers = (brick_count + BRICK_ATLAS_WIDTH*BRICK_ATLAS_WIDTH - 1) / (BRICK_ATLAS_WIDTH*BRICK_ATLAS_WIDTH);
+        width = BRICK_ATLAS_WIDTH * BRICK_APRON_SIZE;
+        height = BRICK_ATLAS_WIDTH * BRICK_APRON_SIZE;
+        depth = std::max<size_t>(layers, 1) * BRICK_APRON_SIZE;
+    }
+
+    // the dense volume as half floats, in the layout of the CL density image
+    void toDenseHalf(std::vector<uint16_t>& dense) const {
+        dense.assign(size_t(size)*size*size, 0);
+        for(int bz = 0; bz < bricks; bz++) for(int by = 0; by < bricks; by++) for(int bx = 0; bx < bricks; bx++) {
+            uint32_t brick = index[(size_t(bz)*bricks + by)*bricks + bx];
+            if(brick == BRICK_EMPTY) continue;
+
+            const uint16_t* voxels = &data[size_t(brick) * brick_voxels];
+            for(int z = 0; z < BRICK_SIZE; z++) for(int y = 0; y < BRICK_SIZE; y++) {
+                size_t row = (size_t(bz*BRICK_SIZE + z)*size + by*BRICK_SIZE + y)*size + bx*BRICK_SIZE;
+                std::memcpy(&dense[row], &voxels[(z*BRICK_SIZE + y)*BRICK_SIZE], BRICK_SIZE*sizeof(uint16_t));
+            }
+        }
+    }
+
+    void toDense(std::vector<float>& dense) const {
+        std::vector<uint16_t> dense_half;
+        toDenseHalf(dense_half);
+        dense.resize(dense_half.size());
+        for(size_t i = 0; i < dense_half.size(); i++) dense[i] = halfToFloat(dense_half[i]);
+    }
+
+    bool save(const std::string& path) const {
+        std::ofstream file(path, std::ios::out | std::ios::binary);
+        if(!file || size <= 0) {
+            std::cerr << "ERROR: BRICK VOLUME: CANNOT SAVE: " << path << std::endl;
+            return false;
+        }
+
+        BrickVolumeHeader header;
+        header.size = size;
+        header.brick_count = uint32_t(brickCount());
+        file.write((const char*)&header, sizeof(header));
+        file.write((const char*)index.data(), index.size()*sizeof(uint32_t));
+        file.write((const char*)data.data(), data.size()*sizeof(uint16_t));
+        return bool(file);
+    }
+
+    bool load(const std::string& path) {
+        std::ifstream file(path, std::ios::in | std::ios::binary);
+        BrickVolumeHeader header;
+        if(file) file.read((char*)&header, sizeof(header));
+        if(!file || std::memcmp(header.magic, "CLBV", 4) != 0 || header.version != 1) {
+            std::cerr << "ERROR: BRICK VOLUME: NOT A BRICK VOLUME FILE: " << path << std::endl;
+            return false;
+        }
+        if(header.brick_size != BRICK_SIZE || header.size == 0 || header.size % BRICK_SIZE != 0 || header.size > 2048) {
+            std::cerr << "ERROR: BRICK VOLUME: UNSUPPORTED SIZE " << header.size << " WITH BRICKS OF " << header.brick_size << ": " << path << std::endl;
+            return false;
+        }
+
+        // a grid has at most one brick per cell, a larger count would only allocate memory for a broken file
+        size_t cells = size_t(header.size / BRICK_SIZE) * (header.size / BRICK_SIZE) * (header.size / BRICK_SIZE);
+        if(header.brick_count > cells) {
+            std::cerr << "ERROR: BRICK VOLUME: " << header.brick_count << " BRICKS FOR " << cells << " CELLS: " << path << std::endl;
+            return false;
+        }
+
+        *this = BrickVolume(int(header.size));
+        data.resize(size_t(header.brick_count) * brick_voxels);
+        file.read((char*)index.data(), index.size()*sizeof(uint32_t));
+        file.read((char*)data.data(), data.size()*sizeof(uint16_t));
+        if(!file) {
+            std::cerr << "ERROR: BRICK VOLUME: TRUNCATED FILE: " << path << std::endl;
+            *this = BrickVolume();
+            return false;
+        }
+
+        for(uint32_t brick : index) {
+            if(brick != BRICK_EMPTY && brick >= header.brick_count) {
+                std::cerr << "ERROR: BRICK VOLUME: INDEX OUT OF RANGE: " << path << std::endl;
+                *this = BrickVolume();
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// writes a brick volume slab by slab into a mapped file, so that the volume never has to be in the memory at once
+// the file is mapped large enough for all the bricks and cut to the stored ones when it is closed
+class BrickVolumeWriter {
+private:
+    MappedFile file;
+    std::string file_path;
+    int size = 0;
+    int bricks = 0;
+    uint32_t brick_count = 0;
+
+    size_t dataOffset() const {
+        return sizeof(BrickVolumeHeader) + size_t(bricks)*bricks*bricks*sizeof(uint32_t);
+    }
+
+public:
+    bool open(const std::string& path, int volume_size) {
+        if(volume_size <= 0 || volume_size % BRICK_SIZE != 0) {
+            std::cerr << "ERROR: BRICK VOLUME: UNSUPPORTED SIZE " << volume_size << ": " << path << std::endl;
+            return false;
+        }
+        file_path = path;
+        size = volume_size;
+        bricks = size / BRICK_SIZE;
+        brick_count = 0;
+        return file.create(path, dataOffset() + size_t(bricks)*bricks*bricks*BrickVolume::brick_voxels*sizeof(uint16_t));
+    }
+
+    // depth slices of half floats from the slice z on, x varies the fastest - z and depth have to be multiples of BRICK_SIZE
+    // and the slabs have to come in the order of z, so that the bricks are stored in the order of the dense grid
+    void writeSlab(int z, int depth, const uint16_t* dense) {
+        uint32_t* index = (uint32_t*)(file.begin() + sizeof(BrickVolumeHeader));
+        uint16_t* data = (uint16_t*)(file.begin() + dataOffset());
+        uint32_t first_brick = brick_count;
+
+        for(int bz = z / BRICK_SIZE; bz < (z + depth) / BRICK_SIZE; bz++) for(int by = 0; by < bricks; by++) for(int bx = 0; bx < bricks; bx++) {
+            // the rows of the brick in the slab
+            const uint16_t* rows[BRICK_SIZE*BRICK_SIZE];
+            bool occupied = false;
+            for(int k = 0; k < BRICK_SIZE; k++) for(int j = 0; j < BRICK_SIZE; j++) {
+                const uint16_t* row = &dense[(size_t(bz*BRICK_SIZE - z + k)*size + by*BRICK_SIZE + j)*size + bx*BRICK_SIZE];
+                rows[k*BRICK_SIZE + j] = row;
+                for(int i = 0; i < BRICK_SIZE; i++) if(row[i] != 0 && !(row[i] & 0x8000)) occupied = true; // positive halves
+            }
+
+            index[(size_t(bz)*bricks + by)*bricks + bx] = occupied ? brick_count : BRICK_EMPTY;
+            if(!occupied) continue;
+
+            uint16_t* voxels = &data[size_t(brick_count) * BrickVolume::brick_voxels];
+            for(int r = 0; r < BRICK_SIZE*BRICK_SIZE; r++) std::memcpy(&voxels[r*BRICK_SIZE], rows[r], BRICK_SIZE*sizeof(uint16_t));
+            brick_count++;
+        }
+
+        size_t index_offset = sizeof(BrickVolumeHeader) + size_t(z / BRICK_SIZE)*bricks*bricks*sizeof(uint32_t);
+        file.flush(index_offset, size_t(depth / BRICK_SIZE)*bricks*bricks*sizeof(uint32_t));
+        file.flush(dataOffset() + size_t(first_brick)*BrickVolume::brick_voxels*sizeof(uint16_t), size_t(brick_count - first_brick)*BrickVolume::brick_voxels*sizeof(uint16_t));
+    }
+
+    size_t brickCount() const {
+        return brick_count;
+    }
+
+    // write the header and cut the file after the last stored brick
+    bool close() {
+        if(!file.isOpen()) return false;
+
+        BrickVolumeHeader header;
+        header.size = size;
+        header.brick_count = brick_count;
+        std::memcpy(file.begin(), &header, sizeof(header));
+
+        file.close(dataOffset() + size_t(brick_count)*BrickVolume::brick_voxels*sizeof(uint16_t));
+        return true;
+    }
+
+    // drop an unfinished volume - the header is never written, and the file is removed so that no reader finds a partial index
+    void abort() {
+        if(!file.isOpen()) return;
+        file.close(0);
+        if(std::remove(file_path.c_str()) != 0) std::cerr << "ERROR: BRICK VOLUME: CANNOT REMOVE THE UNFINISHED FILE: " << file_path << std::endl;
+    }
+};
+
+// reads the bricks straight from the mapping of the file - only the pages of the bricks used are loaded
+class MappedBrickVolume {
+private:
+    MappedFile file;
+    BrickVolumeHeader header;
+    int bricks_count = 0;
+
+    const uint32_t* index() const {
+        return (const uint32_t*)(file.begin() + sizeof(BrickVolumeHeader));
+    }
+
+public:
+    bool open(const std::string& path) {
+        if(!file.open(path)) return false;
+
+        if(file.size() >= sizeof(header)) std::memcpy(&header, file.begin(), sizeof(header));
+        if(file.size() < sizeof(header) || std::memcmp(header.magic, "CLBV", 4) != 0 || header.version != 1) {
+            std::cerr << "ERROR: BRICK VOLUME: NOT A BRICK VOLUME FILE: " << path << std::endl;
+            file.close();
+            return false;
+        }
+        if(header.brick_size != BRICK_SIZE || header.size == 0 || header.size % BRICK_SIZE != 0) {
+            std::cerr << "ERROR: BRICK VOLUME: UNSUPPORTED SIZE " << header.size << " WITH BRICKS OF " << header.brick_size << ": " << path << std::endl;
+            file.close();
+            return false;
+        }
+
+        bricks_count = int(header.size / BRICK_SIZE);
+        size_t index_size = size_t(bricks_count)*bricks_count*bricks_count;
+        if(file.size() < sizeof(header) + index_size*sizeof(uint32_t) + size_t(header.brick_count)*BrickVolume::brick_voxels*sizeof(uint16_t)) {
+            std::cerr << "ERROR: BRICK VOLUME: TRUNCATED FILE: " << path << std::endl;
+            file.close();
+            return false;
+        }
+
+        for(size_t i = 0; i < index_size; i++) {
+            if(index()[i] != BRICK_EMPTY && index()[i] >= header.brick_count) {
+                std::cerr << "ERROR: BRICK VOLUME: INDEX OUT OF RANGE: " << path << std::endl;
+                file.close();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int size() const {
+        return int(header.size);
+    }
+
+    int bricks() const {
+        return bricks_count;
+    }
+
+    size_t brickCount() const {
+        return header.brick_count;
+    }
+
+    // the voxels of a brick, x varies the fastest - nullptr for an empty brick
+    const uint16_t* brick(int bx, int by, int bz) const {
+        uint32_t stored = index()[(size_t(bz)*bricks_count + by)*bricks_count + bx];
+        if(stored == BRICK_EMPTY) return nullptr;
+        const uint16_t* data = (const uint16_t*)(file.begin() + sizeof(BrickVolumeHeader) + size_t(bricks_count)*bricks_count*bricks_count*sizeof(uint32_t));
+        return &data[size_t(stored) * BrickVolume::brick_voxels];
+    }
+
+    float voxel(int x, int y, int z) const {
+        const uint16_t* voxels = brick(x / BRICK_SIZE, y / BRICK_SIZE, z / BRICK_SIZE);
+        if(voxels == nullptr) return 0.0f;
+        return halfToFloat(voxels[((z % BRICK_SIZE)*BRICK_SIZE + y % BRICK_SIZE)*BRICK_SIZE + x % BRICK_SIZE]);
+    }
+
+    // the volume box filtered down to target_size^3 half floats in the layout of the CL density image - only the stored bricks
+    // are read, so the pages of the empty parts of the file are never loaded; target_size must not exceed size()
+    void downsampleHalf(int target_size, std::vector<uint16_t>& dense) const {
+        int n = size();
+        std::vector<float> sum(size_t(target_size)*target_size*target_size, 0.0f);
+
+        // the target voxel of every voxel along an axis, and the voxels falling into every target voxel
+        std::vector<int> cell(n), count(target_size, 0);
+        for(int i = 0; i < n; i++) {
+            cell[i] = int(int64_t(i) * target_size / n);
+            count[cell[i]]++;
+        }
+
+        std::vector<float> half_table(65536);
+        for(size_t h = 0; h < half_table.size(); h++) half_table[h] = halfToFloat(uint16_t(h));
+
+        for(int bz = 0; bz < bricks_count; bz++) for(int by = 0; by < bricks_count; by++) for(int bx = 0; bx < bricks_count; bx++) {
+            const uint16_t* voxels = brick(bx, by, bz);
+            if(voxels == nullptr) continue;
+            for(int z = 0; z < BRICK_SIZE; z++) for(int y = 0; y < BRICK_SIZE; y++) {
+                float* row = &sum[(size_t(cell[bz*BRICK_SIZE + z])*target_size + cell[by*BRICK_SIZE + y])*target_size];
+                for(int x = 0; x < BRICK_SIZE; x++) row[cell[bx*BRICK_SIZE + x]] += half_table[*voxels++];
+            }
+        }
+
+        dense.resize(sum.size());
+        for(int z = 0; z < target_size; z++) for(int y = 0; y < target_size; y++) for(int x = 0; x < target_size; x++) {
+            size_t i = (size_t(z)*target_size + y)*target_size + x;
+            dense[i] = floatToHalf(sum[i] / (float(count[x])*count[y]*count[z]));
+        }
+    }
+};
+
+#endif /* brick_volume_h */
@@ -10,6 +10,7 @@
 
 #include "glm.hpp"
 #include "shader.h"
+#include "frame_uniforms.h"
 
 const float CAMERA_SPEED_SLOW = 0.3f;
 const float CAMERA_SPEED_NORMAL = 1.0f;
@@ -20,6 +21,8 @@ const float PITCH = 0.0f;
 const float ZOOM_MIN = 90.0f;
 const float ZOOM_MAX = 10.0f;
 const float ZOOM_SPEED = 0.5f;
+const float NEAR_PLANE = 0.1f;
+const float FAR_PLANE = 1000.0f;
 
 enum CameraMovementDirection {
     FORWARD,
@@ -44,7 +47,7 @@ private:
     glm::mat4 pvMatrix;
     
     inline void updatePVMatrix() {
-        pvMatrix = glm::perspective(glm::radians(fov), aspect, 0.1f, 1000.0f) * glm::lookAt(glm::vec3(0.0f), w, v);
+        pvMatrix = glm::perspective(glm::radians(fov), aspect, NEAR_PLANE, FAR_PLANE) * glm::lookAt(glm::vec3(0.0f), w, v);
     }
     
     inline void updateVectors() {
@@ -121,11 +124,14 @@ public:
         updateVectors();
     }
     
-    inline void transferData(Shader& shader) const {
-        shader.setVec3("origin", position);
-        shader.setVec3("camera_llc", lower_left_corner);
-        shader.setVec3("horizontal", horizontal);
-        shader.setVec3("vertical", vertical);
+    inline void transferData(FrameData& frame) const {
+        frame.PV = pvMatrix;
+        frame.origin = position;
+        frame.camera_llc = lower_left_corner;
+        frame.horizontal = horizontal;
+        frame.vertical = vertical;
+        frame.near_plane = NEAR_PLANE;
+        frame.far_plane = FAR_PLANE;
     }
     
     inline glm::mat4 transferPVMatrix() const {
@@ -0,0 +1,59 @@
+//
+//  cloud_constants.h
+//  Clouds
+//
+//  Constants of the cloud march, defined once for clouds_fast.fs, the OpenCL kernels and the CPU reference raymarcher.
+//  The shader gets them as defines in front of its code (cloudShaderDefines), the kernels as build options, and the
+//  velocity and the detail scale, which the object shaders need too, travel in the FrameData block.
+//
+
+#ifndef cloud_constants_h
+#define cloud_constants_h
+
+#include <string>
+
+#define CLOUD_SAMPLE_SEP 0.003f // between the samples of the march inside the clouds
+#define CLOUD_SAMPLE_SEP_BLANK 0.01f // and outside them
+#define CLOUD_BOX_SIZE 1.0f
+#define CLOUD_MAIN_RAY_ABSORBTION 200.0f
+#define CLOUD_BRIGHTNESS_AMPLIFY 100.0f // the scattering octaves sum to 1.875 where the light is not attenuated, 190 with single scattering only
+#define CLOUD_MULTI_SCATTER_STRENGTH 1.0f
+
+#define CLOUD_COVERAGE_LOW 0.3f // no clouds where the coverage map is below this
+
+#define CLOUD_DETAIL_SCALE 6.0f // repetitions of the detail volume over the box
+#define CLOUD_DETAIL_BAND 0.35f // only the base density below this is eroded by the detail
+#define CLOUD_DETAIL_STRENGTH 1.0f
+
+#define CLOUD_VELOCITY glm::vec3(0.05f, 0.0f, 0.02f) // drift of the clouds through the box per second
+
+// the colours are the components of a vec3
+#define CLOUD_LIGHT_COL 144.0f/255.0f, 154.0f/255.0f, 171.0f/255.0f
+#define CLOUD_NO_LIGHT_COL 71.0f/255.0f, 73.0f/255.0f, 77.0f/255.0f
+#define CLOUD_BOTTOM_COL 34.0f/255.0f, 41.0f/255.0f, 46.0f/255.0f
+#define CLOUD_TOP_COL 60.0f/255.0f, 69.0f/255.0f, 77.0f/255.0f
+#define CLOUD_MOON_COL 1.5f*203.0f/255.0f, 1.5f*214.0f/255.0f, 1.5f*234.0f/255.0f
+
+#define CLOUD_STRING_(...) #__VA_ARGS__
+#define CLOUD_STRING(...) CLOUD_STRING_(__VA_ARGS__)
+#define CLOUD_DEFINE(name, ...) "#define " name " " CLOUD_STRING(__VA_ARGS__) "\n"
+
+// the defines clouds_fast.fs is compiled with, inserted after its #version line
+inline std::string cloudShaderDefines() {
+    return CLOUD_DEFINE("SAMPLE_SEP", CLOUD_SAMPLE_SEP)
+        CLOUD_DEFINE("SAMPLE_SEP_BLANK", CLOUD_SAMPLE_SEP_BLANK)
+        CLOUD_DEFINE("SIZE", CLOUD_BOX_SIZE)
+        CLOUD_DEFINE("MAIN_RAY_ABSORBTION", CLOUD_MAIN_RAY_ABSORBTION)
+        CLOUD_DEFINE("BRIGHTNESS_AMPLIFY", CLOUD_BRIGHTNESS_AMPLIFY)
+        CLOUD_DEFINE("MULTI_SCATTER_STRENGTH", CLOUD_MULTI_SCATTER_STRENGTH)
+        CLOUD_DEFINE("COVERAGE_LOW", CLOUD_COVERAGE_LOW)
+        CLOUD_DEFINE("DETAIL_BAND", CLOUD_DETAIL_BAND)
+        CLOUD_DEFINE("DETAIL_STRENGTH", CLOUD_DETAIL_STRENGTH)
+        CLOUD_DEFINE("LIGHT_COL", vec3(CLOUD_LIGHT_COL))
+        CLOUD_DEFINE("NO_LIGHT_COL", vec3(CLOUD_NO_LIGHT_COL))
+        CLOUD_DEFINE("BOTTOM_COL", vec3(CLOUD_BOTTOM_COL))
+        CLOUD_DEFINE("TOP_COL", vec3(CLOUD_TOP_COL))
+        CLOUD_DEFINE("MOON_COL", vec3(CLOUD_MOON_COL));
+}
+
+#endif /* cloud_constants_h */
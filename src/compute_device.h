@@ -0,0 +1,200 @@
+//
+//  compute_device.h
+//  Clouds
+//
+//  OpenCL device enumeration, ranking and OpenCL - OpenGL context creation.
+//
+
+#ifndef compute_device_h
+#define compute_device_h
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+//include the OpenCL library (C++ binding)
+#define __CL_ENABLE_EXCEPTIONS
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#include "cl2.hpp"
+
+//include OpenGL libraries and the native context API used for sharing
+#include <GL/glew.h>
+#if defined(__APPLE__)
+#include <OpenGL/OpenGL.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include <GL/glx.h>
+#include <EGL/egl.h>
+#endif
+
+struct ComputeDevice {
+    cl::Platform platform;
+    cl::Device device;
+    std::string name;
+    cl_device_type type;
+    cl_uint compute_units;
+    cl_uint clock_frequency; // MHz
+    cl_ulong global_memory;
+    bool gl_sharing; // supports cl_khr_gl_sharing (or cl_APPLE_gl_sharing)
+
+    // GPUs first, then accelerators, then CPUs
+    int typeRank() const {
+        if(type & CL_DEVICE_TYPE_GPU) return 2;
+        if(type & CL_DEVICE_TYPE_ACCELERATOR) return 1;
+        return 0;
+    }
+
+    // devices of the same type are ranked by their throughput and then by the memory
+    bool betterThan(const ComputeDevice& other) const {
+        if(typeRank() != other.typeRank()) return typeRank() > other.typeRank();
+        cl_ulong throughput = cl_ulong(compute_units) * clock_frequency;
+        cl_ulong other_throughput = cl_ulong(other.compute_units) * other.clock_frequency;
+        if(throughput != other_throughput) return throughput > other_throughput;
+        if(global_memory != other.global_memory) return global_memory > other.global_memory;
+        return gl_sharing && !other.gl_sharing;
+    }
+};
+
+// list the devices of all the platforms, the best one first
+inline std::vector<ComputeDevice> enumerateComputeDevices() {
+    std::vector<ComputeDevice> result;
+
+    std::vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+
+    for(cl::Platform& platform : platforms) {
+        std::vector<cl::Device> devices;
+        try {
+            platform.getDevices(CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_CPU | CL_DEVICE_TYPE_ACCELERATOR, &devices);
+        } catch(cl::Error e) {
+            continue; // CL_DEVICE_NOT_FOUND
+        }
+
+        for(cl::Device& device : devices) {
+            if(!device.getInfo<CL_DEVICE_AVAILABLE>() || !device.getInfo<CL_DEVICE_IMAGE_SUPPORT>()) continue;
+
+            ComputeDevice d;
+            d.platform = platform;
+            d.device = device;
+            d.name = device.getInfo<CL_DEVICE_NAME>();
+            d.type = device.getInfo<CL_DEVICE_TYPE>();
+            d.compute_units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+            d.clock_frequency = std::max(device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>(), cl_uint(1));
+            d.global_memory = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+
+            std::string extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+            d.gl_sharing = extensions.find("cl_khr_gl_sharing") != std::string::npos || extensions.find("cl_APPLE_gl_sharing") != std::string::npos;
+
+            result.push_back(d);
+        }
+    }
+
+    std::stable_sort(result.begin(), result.end(), [](const ComputeDevice& a, const ComputeDevice& b) {
+        return a.betterThan(b);
+    });
+
+    return result;
+}
+
+// pick the best device - the CLOUDS_CL_DEVICE environment variable can force an index of the ranked list
+inline ComputeDevice selectComputeDevice() {
+    std::vector<ComputeDevice> devices = enumerateComputeDevices();
+    if(devices.size() == 0) {
+        std::cerr << "ERROR: OpenCL: NO DEVICES FOUND" << std::endl;
+        exit(-1);
+    }
+
+    for(size_t i = 0; i < devices.size(); i++) {
+        std::cout << "OpenCL: DEVICE " << i << ": " << devices[i].name << ", compute units: " << devices[i].compute_units << ", memory MB: " << (devices[i].global_memory >> 20) << (devices[i].gl_sharing ? ", GL sharing" : "") << std::endl;
+    }
+
+    size_t index = 0;
+    if(const char* forced = std::getenv("CLOUDS_CL_DEVICE")) {
+        index = std::strtoul(forced, nullptr, 10);
+        if(index >= devices.size()) {
+            std::cerr << "ERROR: OpenCL: CLOUDS_CL_DEVICE OUT OF RANGE, USING DEVICE 0" << std::endl;
+            index = 0;
+        }
+    }
+
+    return devices[index];
+}
+
+// extra devices the volume generation is split across - the CLOUDS_CL_SLAB_DEVICES environment variable lists
+// indices of the ranked list ("1,2") or "all", by default only the selected device generates the volume
+inline std::vector<ComputeDevice> selectSlabDevices(const ComputeDevice& selected) {
+    std::vector<ComputeDevice> result;
+    const char* list = std::getenv("CLOUDS_CL_SLAB_DEVICES");
+    if(list == nullptr) return result;
+
+    std::vector<ComputeDevice> devices = enumerateComputeDevices();
+    std::string indices = list;
+    for(size_t i = 0; i < devices.size(); i++) {
+        if(devices[i].device() == selected.device()) continue;
+
+        bool listed = indices == "all";
+        size_t start = 0;
+        while(!listed && start < indices.size()) {
+            size_t end = indices.find(',', start);
+            if(end == std::string::npos) end = indices.size();
+            listed = indices.substr(start, end - start) == std::to_string(i);
+            start = end + 1;
+        }
+        if(listed) result.push_back(devices[i]);
+    }
+    return result;
+}
+
+// create a context sharing objects with the current OpenGL context - falls back to a plain context (and sets gl_sharing to false) if it is not possible
+inline cl::Context createComputeContext(ComputeDevice& d) {
+    if(d.gl_sharing) {
+        try {
+            // https://stackoverflow.com/questions/26802905/getting-opengl-buffers-using-opencl
+            #if defined(__APPLE__)
+            CGLContextObj kCGLContext = CGLGetCurrentContext();
+            CGLShareGroupObj kCGLShareGroup = CGLGetShareGroup(kCGLContext);
+
+            cl_context_properties properties[] = {
+                CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE, (cl_context_properties)kCGLShareGroup,
+                0
+            };
+            #elif defined(_WIN32)
+            cl_context_properties properties[] = {
+                CL_GL_CONTEXT_KHR, (cl_context_properties)wglGetCurrentContext(),
+                CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
+                CL_CONTEXT_PLATFORM, (cl_context_properties)d.platform(),
+                0
+            };
+            #else
+            // GLFW creates either a GLX or an EGL context on Linux
+            cl_context_properties properties[] = {
+                CL_GL_CONTEXT_KHR, 0,
+                CL_GLX_DISPLAY_KHR, 0,
+                CL_CONTEXT_PLATFORM, (cl_context_properties)d.platform(),
+                0
+            };
+            if(glXGetCurrentContext() != NULL) {
+                properties[1] = (cl_context_properties)glXGetCurrentContext();
+                properties[3] = (cl_context_properties)glXGetCurrentDisplay();
+            } else {
+                properties[1] = (cl_context_properties)eglGetCurrentContext();
+                properties[2] = CL_EGL_DISPLAY_KHR;
+                properties[3] = (cl_context_properties)eglGetCurrentDisplay();
+            }
+            #endif
+
+            return cl::Context(d.device, properties);
+        } catch(cl::Error e) {
+            std::cerr << "ERROR: OpenCL: CANNOT SHARE THE OpenGL CONTEXT: " << e.err() << ", USING STAGED COPIES" << std::endl;
+            d.gl_sharing = false;
+        }
+    }
+
+    return cl::Context(d.device);
+}
+
+#endif /* compute_device_h */
@@ -11,6 +11,19 @@
 
 #define CHANNELS 4
 #define ITERATIONS 3
+#define BASE_ITERATIONS 1 // the first octaves make the base shape volume, the others the tileable detail volume
+
+#define CHANNELS_KERNEL_PATH "src/kernels/generate_channels.ocl"
+#define DENSITY_KERNEL_PATH "src/kernels/generate_3d_cloud.ocl" // density and light
+#define COVERAGE_KERNEL_PATH "src/kernels/generate_coverage.ocl"
+
+#define COVERAGE_SIZE 512 // of the 2D coverage map, which spans the whole cloud box like the 3D volume
+#define COVERAGE_OCTAVES 3
+
+#define OUT_OF_CORE_SLAB_BYTES (512ull << 20) // device memory of the images of a slab of an out of core volume
+
+#define LIGHT_KEYS 3 // light volumes kept at once: two around the current light direction and one being baked for the next direction
+#define LIGHT_DIVISOR 2 // the light volumes have size/LIGHT_DIVISOR texels along each axis - 1, 2 or 4
 
 #include <fstream>
 #include <string>
@@ -18,24 +31,51 @@
 #include <random>
 #include <cmath>
 #include <vector>
+#include <map>
+#include <iomanip>
+#include <type_traits>
+#include <chrono>
+#include <future>
 
-//include the OpenCL library (C++ binding)
-#define __CL_ENABLE_EXCEPTIONS
-#define CL_HPP_TARGET_OPENCL_VERSION 120
-#define CL_HPP_MINIMUM_OPENCL_VERSION 120
-#include "cl2.hpp"
+//include the OpenCL library and the device selection
+#include "compute_device.h"
 
 //include OpenGL libraries
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include "glm.hpp"
+
+#include "shader.h"
+#include "frame_uniforms.h"
+#include "cpu_raymarcher.h"
+#include "brick_volume.h"
+#include "slab_scheduler.h"
+
+// the same values are defined in generate_3d_cloud.ocl
+enum BrushShape {
+    BRUSH_SPHERE,
+    BRUSH_BOX
+};
+
+// a local change of the density, see Clouds::editDensity
+struct DensityBrush {
+    BrushShape shape = BRUSH_SPHERE;
+    glm::vec3 center = glm::vec3(0.5f); // in the box, from 0 to 1
+    glm::vec3 extent = glm::vec3(0.1f); // radii of the sphere or half the edges of the box
+    float amount = -1.0f; // added to the density inside, negative values carve
+    float softness = 0.5f; // part of the extent over which the brush fades out
+    float noise = 0.0f; // 0 - a smooth brush, 1 - its weight is scaled by the detail noise
+};
 
 class Clouds {
 private:
-    const int size = 320;
+    const int size = 96; // of the base shape volume - the large shapes come from the coverage map
+    const int detail_size = 64; // of the detail volume, repeated CLOUD_DETAIL_SCALE times over the box
+    const int light_size = size / LIGHT_DIVISOR; // the light varies much more smoothly than the density
     const int nodes[ITERATIONS][CHANNELS] = {
-        {1, 3,  6,  32},
-        {2, 10,  30, 128},
-        {2, 40, 60, 200}
+        {1, 3,  6,  12},
+        {2, 4,  8,  16},
+        {4, 8, 16,  32}
     };
     const cl_float persistence[ITERATIONS][CHANNELS] = {
         {15.0f, 15.0f, 15.0f, 15.0f},
@@ -44,12 +84,106 @@ private:
     };
     const cl_float blending[ITERATIONS][CHANNELS] = {
         {1.0f, 1.0f, 1.0f, 1.0f},
-        {0.3f, 0.3f, 0.3f, 0.3f},
-        {0.1f, 0.1f, 0.1f, 0.1f}
+        {1.0f, 1.0f, 1.0f, 1.0f}, // first detail octave
+        {0.3f, 0.3f, 0.3f, 0.3f}
+    };
+    const cl_float density_weights[CHANNELS] = {0.03f, 0.7f, 0.2f, 0.07f};
+    const cl_float detail_weights[CHANNELS] = {0.1f, 0.4f, 0.3f, 0.2f};
+    
+    // coverage (R) and cloud type (G) octaves of the coverage map, 0 nodes - unused octave
+    const int coverage_nodes[2][COVERAGE_OCTAVES] = {
+        {4, 8, 32},
+        {2, 0, 0}
+    };
+    const cl_float coverage_persistence[2][COVERAGE_OCTAVES] = {
+        {3.0f, 5.0f, 8.0f},
+        {2.0f, 0.0f, 0.0f}
+    };
+    const cl_float coverage_blending[2][COVERAGE_OCTAVES] = {
+        {1.0f, 0.35f, 0.15f},
+        {1.0f, 0.0f, 0.0f}
+    };
+    const cl_float coverage_high = 0.7f;
+    const cl_float type_min_top = 0.5f;
+    
+    // density and light parameters - passed to the kernel as build options
+    const bool repeating = true;
+    const cl_float cutoff = 0.35f;
+    const cl_float cutoff_2 = 0.3f;
+    const cl_float slope = 40.0f;
+    const cl_float light_absorbtion = 10.0f;
+    const cl_float sample_sep_light = 0.01f;
+    const int ms_octaves = 4; // multiple scattering octaves, baked into channel G of the light volumes
+    const cl_float ms_attenuation = 0.5f;
+    const cl_float ms_contribution = 0.5f;
+    
+    // the light moves over an arc from the horizon to the horizon, the light volume is baked every light_key_step radians
+    const float light_angle_min = 0.0873f; // the light march needs the light above the horizon
+    const float light_key_step = 0.1745f;
+    const int light_slices_per_update = 16; // z-slices of the next light volume baked every frame
+    
+    // the density is rendered from the occupied bricks only
+    cl_GLuint atlas_texture_ID;
+    GLuint brick_index_texture_ID; // atlas position of every brick, alpha is 0 for the empty ones
+    GLint texture_loc;
+    GLint brick_index_loc;
+    GLuint coverage_texture_ID;
+    GLint coverage_loc;
+    GLuint detail_texture_ID;
+    GLint detail_loc;
+    size_t atlas_size[3] = {0, 0, 0};
+    
+    struct LightKey {
+        GLuint texture_ID = 0;
+        int index = -1; // holds the light for the angle light_angle_min + index*light_key_step
+        int baked_slices = 0;
     };
+    LightKey light_keys[LIGHT_KEYS];
+    float light_angle = 1.0427f; // elevation of the original light direction (0.5, 1.0, -0.3)
+    bool light_rising = true;
+    
+    GLint light_loc[2];
+    GLint light_blend_loc;
+    
+    // transmittance of the clouds over the bottom of the box, for the scene objects
+    GLuint shadow_texture_ID;
+    cl::Image2D shadow_image;
+    cl::Kernel generate_shadow;
+    float shadow_angle = -1.0f; // light angle the shadow map was generated for, negative if it is not valid
+    
+    cl::Image3D channel_image; // kept to re-run the density stage when its kernel is reloaded
+    std::vector<cl_uint> base_vertices[BASE_ITERATIONS][CHANNELS]; // replaces channel_image when the base volume is split into slabs
+    std::vector<cl_float> coverage_data; // host copy of coverage_image, uploaded to every slab worker
+    cl::Image3D detail_channel_image;
+    cl::Image3D detail_image;
+    cl::Image2D coverage_image;
+    cl::Image3D density_image; // dense, read by the light kernel
+    cl::Image3D atlas_image;
+    std::vector<uint32_t> brick_index; // atlas slot of every brick or BRICK_EMPTY
+    std::vector<cl_uint> free_slots; // atlas slots without a brick, taken by the bricks the edits fill
+    cl::Image3D light_image;
+    cl::Kernel generate_light;
     
-    cl_GLuint cloud_texture_ID;
-    GLuint texture_loc;
+    unsigned int seed; // of the feature points, so that reloading the channel kernel keeps the shape of the clouds
+    
+    ComputeDevice compute_device;
+    cl::Context context;
+    cl::Device device;
+    cl::CommandQueue queue;
+    std::map<std::string, std::string> kernel_sources; // kernel files by their paths
+    std::map<std::string, cl::Program> programs; // kernel variants cached by their files and build options
+    SlabScheduler slabs; // the selected device and the extra ones, the base volume is split between them if there are any
+    
+    int channel_tile = 0; // work-group edge of the tiled generate_channels, 0 - image sampler version
+    
+    std::map<GLuint, cl::ImageGL> shared_textures; // used if the device can share objects with OpenGL
+    GLuint staging_buffer = 0; // used otherwise
+    
+    // a box of texels of an image
+    struct ImageRegion {
+        cl::array<size_t, 3> origin;
+        cl::array<size_t, 3> region;
+    };
     
     struct pos{
         int x, y, z;
@@ -61,8 +195,7 @@ private:
         }
     };
     
-    std::string loadSource(const char* compute_path) {
-        std::string compute_code;
+    bool loadSource(const std::string& compute_path, std::string& compute_code) {
         std::ifstream compute_file;
         compute_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
         
@@ -73,21 +206,244 @@ private:
             compute_file.close();
             compute_code = compute_stream.str();
         } catch(std::ifstream::failure e) {
-            std::cerr << "ERROR: OpenCL KERNEL: CANNOT READ KERNEL CODE" << std::endl;
-            exit(-1); //stop executing the program with the error code -1;
+            std::cerr << "ERROR: OpenCL KERNEL: CANNOT READ KERNEL CODE: " << compute_path << std::endl;
+            return false;
         }
-        return compute_code;
+        return true;
+    }
+    
+    static std::string floatOption(const char* name, cl_float value) {
+        std::ostringstream option;
+        option << std::showpoint << std::setprecision(9) << " -D " << name << "=" << value << "f";
+        return option.str();
     }
     
-    // FOR NOW JUST SEND DATA IN THE RED CHANNEL
+    template<typename T>
+    static std::string vectorOption(const char* name, const T* values, int count, const char* type) {
+        std::ostringstream option;
+        option << std::showpoint << std::setprecision(9) << " -D " << name << "=(" << type << "4)(";
+        for(int k = 0; k < 4; k++) {
+            if(k > 0) option << ",";
+            if(std::is_floating_point<T>::value) option << (k < count ? values[k] : T(0)) << "f";
+            else option << (k < count ? values[k] : T(0));
+        }
+        option << ")";
+        return option.str();
+    }
+    
+    // size of the volume the octave m is generated in
+    int octaveSize(int m) const {
+        return m < BASE_ITERATIONS ? size : detail_size;
+    }
+    
+    // number of feature point cells a tile^3 work-group needs to keep in the local memory
+    int localCells(int m, int tile) const {
+        int cells = 0;
+        for(int k = 0; k < CHANNELS; k++) {
+            int grid_size = octaveSize(m)/nodes[m][k];
+            int edge = (tile+grid_size-2)/grid_size + 3;
+            cells = std::max(cells, edge*edge*edge);
+        }
+        return cells;
+    }
+    
+    bool tileFits(int m, int tile) const {
+        if(tile <= 0 || octaveSize(m) % tile != 0) return false;
+        if(size_t(tile*tile*tile) > device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>()) return false;
+        if(size_t(tile) > device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>()[2]) return false;
+        return localCells(m, tile)*sizeof(cl_int4) <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    }
+    
+    // octave_size is the size of the volume the octave is generated in, the out of core volumes are larger than octaveSize(m)
+    std::string channelOptions(int m, int tile, int octave_size) const {
+        int grid_size[CHANNELS];
+        bool blend = false;
+        for(int k = 0; k < CHANNELS; k++) {
+            grid_size[k] = octave_size/nodes[m][k];
+            if(blending[m][k] < 1.0f) blend = true;
+        }
+        
+        std::string options = " -D CHANNELS=" + std::to_string(CHANNELS);
+        options += vectorOption("GRID_SIZE", grid_size, CHANNELS, "int");
+        options += vectorOption("PERSISTENCE", persistence[m], CHANNELS, "float");
+        if(blend) {
+            options += " -D BLEND";
+            options += vectorOption("BLENDING", blending[m], CHANNELS, "float");
+        }
+        if(tile > 0) {
+            options += " -D TILE=" + std::to_string(tile);
+            options += " -D LOCAL_CELLS=" + std::to_string(localCells(m, tile));
+        }
+        return options;
+    }
+    
+    std::string densityOptions() const {
+        std::string options = " -D REPEATING=" + std::to_string(int(repeating));
+        options += floatOption("CUTOFF", cutoff);
+        options += floatOption("CUTOFF_2", cutoff_2);
+        options += floatOption("SLOPE", slope);
+        options += floatOption("LIGHT_ABSORBTION", light_absorbtion);
+        options += floatOption("SAMPLE_SEP_LIGHT", sample_sep_light);
+        options += " -D MS_OCTAVES=" + std::to_string(ms_octaves);
+        options += floatOption("MS_ATTENUATION", ms_attenuation);
+        options += floatOption("MS_CONTRIBUTION", ms_contribution);
+        options += vectorOption("DENSITY_WEIGHTS", density_weights, CHANNELS, "float");
+        options += vectorOption("DETAIL_WEIGHTS", detail_weights, CHANNELS, "float");
+        options += floatOption("DETAIL_SCALE", CLOUD_DETAIL_SCALE);
+        options += floatOption("COVERAGE_LOW", CLOUD_COVERAGE_LOW);
+        options += floatOption("COVERAGE_HIGH", coverage_high);
+        options += floatOption("TYPE_MIN_TOP", type_min_top);
+        options += " -D BRICK_SIZE=" + std::to_string(BRICK_SIZE);
+        options += " -D BRICK_ATLAS_WIDTH=" + std::to_string(BRICK_ATLAS_WIDTH);
+        return options;
+    }
+    
+    // build the kernel file specialised with the given options - every variant is built only once
+    cl::Program& getProgram(const std::string& path, const std::string& options) {
+        std::string key = path + "|" + options;
+        auto it = programs.find(key);
+        if(it != programs.end()) return it->second;
+        
+        const std::string& kernel_code = kernel_sources[path];
+        cl::Program::Sources sources;
+        sources.push_back({kernel_code.c_str(), kernel_code.length()});
+        cl::Program program(context, sources);
+        
+        try {
+            program.build({device}, options.c_str());
+        } catch(cl::Error e) {
+            if(e.err() == CL_BUILD_PROGRAM_FAILURE) {
+                std::cerr << "ERROR: OpenCL: CANNOT BUILD " << path << " WITH OPTIONS:" << options << "\n" << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+            }
+            throw;
+        }
+        
+        return programs.emplace(key, program).first->second;
+    }
     
-    void generateGLTexture(Shader& shader) {
+    // run generate_channels for the octave m and return the kernel time in ms (-1 if the built variant cannot run the tile)
+    double runChannels(int m, int tile, cl::Image3D* vertices_image, cl::Image3D& image_in, cl::Image3D& image_out) {
+        cl::Kernel generate_channels(getProgram(CHANNELS_KERNEL_PATH, channelOptions(m, tile, octaveSize(m))), "generate_channels");
+        if(tile > 0 && generate_channels.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device) < size_t(tile*tile*tile)) return -1.0;
+        
+        for(int k = 0; k < CHANNELS; k++) generate_channels.setArg(k, vertices_image[k]);
+        generate_channels.setArg(CHANNELS, image_in);
+        generate_channels.setArg(CHANNELS+1, image_out);
+        
+        size_t octave_size = octaveSize(m);
+        cl::Event event;
+        queue.enqueueNDRangeKernel(generate_channels, cl::NullRange, cl::NDRange(octave_size, octave_size, octave_size), tile > 0 ? cl::NDRange(size_t(tile), size_t(tile), size_t(tile)) : cl::NullRange, nullptr, &event);
+        event.wait();
+        
+        return (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-6;
+    }
+    
+    // choose the work-group edge of the tiled variant using the first octave - every variant writes the same result
+    // the largest tile that fits is the default, CLOUDS_CL_TUNE_TILE times the variants against the image sampler one instead
+    void tuneChannelTile(cl::Image3D* vertices_image, cl::Image3D& image_in, cl::Image3D& image_out) {
+        channel_tile = 0;
+        
+        if(std::getenv("CLOUDS_CL_TUNE_TILE") == nullptr) {
+            for(int tile : {8, 4, 2}) {
+                if(tileFits(0, tile) && runChannels(0, tile, vertices_image, image_in, image_out) >= 0.0) {
+                    channel_tile = tile;
+                    return;
+                }
+            }
+            runChannels(0, 0, vertices_image, image_in, image_out);
+            return;
+        }
+        
+        double best_time = runChannels(0, 0, vertices_image, image_in, image_out);
+        std::cout << "OpenCL: generate_channels (image sampler): " << best_time << " ms" << std::endl;
+        
+        for(int tile : {8, 4, 2}) {
+            if(!tileFits(0, tile)) continue;
+            double time = runChannels(0, tile, vertices_image, image_in, image_out);
+            if(time < 0.0) continue;
+            std::cout << "OpenCL: generate_channels (local memory, tile " << tile << "^3): " << time << " ms" << std::endl;
+            if(time < best_time) {
+                best_time = time;
+                channel_tile = tile;
+            }
+        }
+    }
+    
+    // copy regions of an image to a GL texture of the matching format (image_format and image_type describe a single texel)
+    void copyToTexture(const cl::Image3D& image, GLuint texture_ID, const std::vector<ImageRegion>& regions, GLenum image_format, GLenum image_type, size_t texel_size) {
+        if(regions.empty()) return;
+        
+        if(compute_device.gl_sharing) {
+            auto it = shared_textures.find(texture_ID);
+            if(it == shared_textures.end()) {
+                it = shared_textures.emplace(texture_ID, cl::ImageGL(context, CL_MEM_WRITE_ONLY, GL_TEXTURE_3D, 0, texture_ID)).first;
+            }
+            
+            std::vector<cl::Memory> gl_objects = {it->second};
+            
+            glFinish();
+            queue.enqueueAcquireGLObjects(&gl_objects);
+            for(const ImageRegion& r : regions) queue.enqueueCopyImage(image, it->second, r.origin, r.origin, r.region);
+            queue.enqueueReleaseGLObjects(&gl_objects);
+            queue.finish();
+        } else {
+            // stage the data through a mapped pixel buffer: OpenCL writes straight into the driver's memory, one region after another
+            size_t bytes = 0;
+            for(const ImageRegion& r : regions) bytes += r.region[0] * r.region[1] * r.region[2] * texel_size;
+            
+            if(staging_buffer == 0) glGenBuffers(1, &staging_buffer);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging_buffer);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+            
+            char* staging = (char*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+            if(staging == nullptr) {
+                std::cerr << "ERROR: OpenGL: CANNOT MAP THE STAGING BUFFER OF TEXTURE " << texture_ID << ": " << glGetError() << std::endl;
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                return;
+            }
+            
+            size_t offset = 0;
+            try {
+                for(const ImageRegion& r : regions) {
+                    queue.enqueueReadImage(image, CL_FALSE, r.origin, r.region, 0, 0, staging + offset);
+                    offset += r.region[0] * r.region[1] * r.region[2] * texel_size;
+                }
+                queue.finish();
+            } catch(cl::Error&) {
+                // the reads already enqueued still write into the mapping, the buffer is given back to the GL only after them
+                try {
+                    queue.finish();
+                } catch(cl::Error&) {}
+                glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                throw;
+            }
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glBindTexture(GL_TEXTURE_3D, texture_ID);
+            offset = 0;
+            for(const ImageRegion& r : regions) {
+                glTexSubImage3D(GL_TEXTURE_3D, 0, GLint(r.origin[0]), GLint(r.origin[1]), GLint(r.origin[2]), GLsizei(r.region[0]), GLsizei(r.region[1]), GLsizei(r.region[2]), image_format, image_type, (void*)offset);
+                offset += r.region[0] * r.region[1] * r.region[2] * texel_size;
+            }
+            
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+    }
+    
+    void copyToTexture(const cl::Image3D& image, GLuint texture_ID, const cl::array<size_t, 3>& origin, const cl::array<size_t, 3>& region, GLenum image_format, GLenum image_type, size_t texel_size) {
+        copyToTexture(image, texture_ID, std::vector<ImageRegion>{{origin, region}}, image_format, image_type, texel_size);
+    }
+    
+    GLuint generateGLTexture(GLenum internal_format, GLenum format, int texture_size) {
+        GLuint texture_ID;
         
         glEnable(GL_TEXTURE_3D);
         
-        glGenTextures(1, &cloud_texture_ID);
+        glGenTextures(1, &texture_ID);
         
-        glBindTexture(GL_TEXTURE_3D, cloud_texture_ID);
+        glBindTexture(GL_TEXTURE_3D, texture_ID);
         
         glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
         
@@ -97,191 +453,1199 @@ private:
         glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); //USE NEAREST TO SPEED UP
         glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         
-        // FOR RGBA: glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA32F, size, size, size, 0, GL_RGBA, GL_FLOAT, NULL);
-        glTexImage3D(GL_TEXTURE_3D, 0, GL_RG, size, size, size, 0, GL_RED, GL_FLOAT, NULL);
-        
-        texture_loc = glGetUniformLocation(shader.ID, "density_sampler");
+        // sized formats, so that they match the CL_HALF_FLOAT images the data is generated in
+        glTexImage3D(GL_TEXTURE_3D, 0, internal_format, texture_size, texture_size, texture_size, 0, format, GL_HALF_FLOAT, NULL);
         
         glFinish();
+        
+        return texture_ID;
     }
     
-public:
-    Clouds(Shader& shader) {
-        cl::Device device;
-        cl::Program computing_program;
+    GLuint generateAtlasTextures() {
+        GLuint texture_ID;
+        glGenTextures(1, &texture_ID);
+        glBindTexture(GL_TEXTURE_3D, texture_ID);
+        // the apron of the bricks makes the filtering inside the atlas match the dense texture
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         
-        try {
-            std::vector<cl::Platform> platforms;
-            std::vector<cl::Device> devices;
-            cl::Platform::get(&platforms);
-            if(platforms.size() == 0) {
-                std::cerr << "ERROR: OpenCL: NO PLATFORMS FOUND" << std::endl;;
-            }
-            
-            platforms[0].getDevices(CL_DEVICE_TYPE_GPU, &devices);
-            if(devices.size() == 0) {
-                std::cerr << "ERROR: OpenCL: NO DEVICES FOUND" << std::endl;
-            }
-            device = devices[1]; //choose the graphics card
+        // read with texelFetch only, the grid of the bricks never changes so the storage is allocated once
+        int bricks = size / BRICK_SIZE;
+        glGenTextures(1, &brick_index_texture_ID);
+        glBindTexture(GL_TEXTURE_3D, brick_index_texture_ID);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA8UI, bricks, bricks, bricks, 0, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, NULL);
+        
+        return texture_ID;
+    }
+    
+    // find the occupied bricks of density_image and pack them into the atlas
+    void packBricks() {
+        int bricks = size / BRICK_SIZE;
+        size_t brick_total = size_t(bricks)*bricks*bricks;
+        cl::Program& program = getProgram(DENSITY_KERNEL_PATH, densityOptions());
+        
+        cl::Buffer occupied_buffer(context, CL_MEM_WRITE_ONLY, brick_total);
+        cl::Kernel brick_occupancy(program, "brick_occupancy");
+        brick_occupancy.setArg(0, density_image);
+        brick_occupancy.setArg(1, occupied_buffer);
+        brick_occupancy.setArg(2, cl_int(bricks));
+        queue.enqueueNDRangeKernel(brick_occupancy, cl::NullRange, cl::NDRange(size_t(bricks), size_t(bricks), size_t(bricks)), cl::NullRange);
+        
+        std::vector<cl_uchar> occupied(brick_total);
+        queue.enqueueReadBuffer(occupied_buffer, CL_TRUE, 0, brick_total, occupied.data());
+        
+        // the bricks are stored in the order of the dense grid
+        std::vector<cl_uint> sources;
+        brick_index.assign(brick_total, BRICK_EMPTY);
+        for(size_t i = 0; i < brick_total; i++) {
+            if(!occupied[i]) continue;
+            brick_index[i] = cl_uint(sources.size());
+            sources.push_back(cl_uint(i));
+        }
+        
+        size_t width, height, depth;
+        BrickVolume::atlasSize(sources.size(), width, height, depth);
+        
+        // the rest of the last layer of the atlas, the lowest slots are taken first
+        size_t slots = (width / BRICK_APRON_SIZE) * (height / BRICK_APRON_SIZE) * (depth / BRICK_APRON_SIZE);
+        free_slots.clear();
+        for(size_t slot = slots; slot > sources.size(); slot--) free_slots.push_back(cl_uint(slot - 1));
+        if(width != atlas_size[0] || height != atlas_size[1] || depth != atlas_size[2]) {
+            atlas_size[0] = width;
+            atlas_size[1] = height;
+            atlas_size[2] = depth;
+            atlas_image = cl::Image3D(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_HALF_FLOAT), width, height, depth);
             
-            std::cout << "SUCCESS: OpenCL: USING A DEVICE: " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
+            // the shared image refers to the old storage of the texture
+            shared_textures.erase(atlas_texture_ID);
+            glBindTexture(GL_TEXTURE_3D, atlas_texture_ID);
+            glTexImage3D(GL_TEXTURE_3D, 0, GL_R16F, GLsizei(width), GLsizei(height), GLsizei(depth), 0, GL_RED, GL_HALF_FLOAT, NULL);
+        }
+        
+        if(!sources.empty()) {
+            cl::Buffer sources_buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sources.size()*sizeof(cl_uint), sources.data());
+            cl::Kernel pack_bricks(program, "pack_bricks");
+            pack_bricks.setArg(0, density_image);
+            pack_bricks.setArg(1, sources_buffer);
+            pack_bricks.setArg(2, atlas_image);
+            pack_bricks.setArg(3, cl_int(bricks));
+            queue.enqueueNDRangeKernel(pack_bricks, cl::NullRange, cl::NDRange(BRICK_APRON_SIZE, BRICK_APRON_SIZE, BRICK_APRON_SIZE*sources.size()), cl::NullRange);
+            queue.finish();
             
-            // OpenCl - OpenGL interop
-            // https://stackoverflow.com/questions/26802905/getting-opengl-buffers-using-opencl
+            copyToTexture(atlas_image, atlas_texture_ID, {0, 0, 0}, {width, height, depth}, GL_RED, GL_HALF_FLOAT, sizeof(cl_half));
+        }
+        
+        std::vector<std::pair<int, int>> whole[3] = {{{0, bricks}}, {{0, bricks}}, {{0, bricks}}};
+        uploadBrickIndex(whole);
+        
+        size_t dense_bytes = size_t(size)*size*size*sizeof(cl_half);
+        size_t atlas_bytes = width*height*depth*sizeof(cl_half) + 4*brick_total;
+        std::cout << "Clouds: " << sources.size() << " of " << brick_total << " bricks occupied, density texture " << atlas_bytes/(1024*1024) << " MB instead of " << dense_bytes/(1024*1024) << " MB" << std::endl;
+    }
+    
+    // the atlas position of the bricks in the ranges (first, count) along every axis for the shader, one box of bricks at a time
+    void uploadBrickIndex(const std::vector<std::pair<int, int>>* ranges) {
+        int bricks = size / BRICK_SIZE;
+        std::vector<GLubyte> index_data;
+        
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glBindTexture(GL_TEXTURE_3D, brick_index_texture_ID);
+        for(auto& x : ranges[0]) for(auto& y : ranges[1]) for(auto& z : ranges[2]) {
+            index_data.assign(4*size_t(x.second)*y.second*z.second, 0);
+            GLubyte* texel = index_data.data();
+            for(int bz = z.first; bz < z.first + z.second; bz++) for(int by = y.first; by < y.first + y.second; by++) for(int bx = x.first; bx < x.first + x.second; bx++, texel += 4) {
+                uint32_t brick = brick_index[(size_t(bz)*bricks + by)*bricks + bx];
+                if(brick == BRICK_EMPTY) continue;
+                int ax, ay, az;
+                BrickVolume::atlasPosition(brick, ax, ay, az);
+                texel[0] = GLubyte(ax);
+                texel[1] = GLubyte(ay);
+                texel[2] = GLubyte(az);
+                texel[3] = 1;
+            }
+            glTexSubImage3D(GL_TEXTURE_3D, 0, x.first, y.first, z.first, x.second, y.second, z.second, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, index_data.data());
+        }
+        glBindTexture(GL_TEXTURE_3D, 0);
+    }
+    
+    // LIGHT KEYS
+    
+    int lightKeyCount() const {
+        return int((M_PI - 2.0f*light_angle_min) / light_key_step) + 1;
+    }
+    
+    float lightKeyAngle(int index) const {
+        return light_angle_min + index*light_key_step;
+    }
+    
+    // index of the key below the current light angle, the key above is index+1
+    int lightKeyIndex() const {
+        int index = int((light_angle - light_angle_min) / light_key_step);
+        return std::max(0, std::min(index, lightKeyCount()-2));
+    }
+    
+    int findLightKey(int index, bool baked_only) const {
+        for(int i = 0; i < LIGHT_KEYS; i++) {
+            if(light_keys[i].index == index && (!baked_only || light_keys[i].baked_slices == light_size)) return i;
+        }
+        return -1;
+    }
+    
+    // a slot which holds none of the keys index and index+1
+    int freeLightKey(int index) const {
+        for(int i = 0; i < LIGHT_KEYS; i++) {
+            if(light_keys[i].index != index && light_keys[i].index != index+1) return i;
+        }
+        return -1;
+    }
+    
+    // bake the next z-slices of the key in the given slot
+    void bakeLightKey(int slot, int slices) {
+        LightKey& key = light_keys[slot];
+        size_t z = key.baked_slices;
+        size_t depth = std::min(slices, light_size - key.baked_slices);
+        
+        glm::vec3 dir = lightDirection(lightKeyAngle(key.index));
+        cl_float4 light_dir = {{dir.x, dir.y, dir.z, 0.0f}};
+        
+        generate_light.setArg(0, density_image);
+        generate_light.setArg(1, light_image);
+        generate_light.setArg(2, light_dir);
+        queue.enqueueNDRangeKernel(generate_light, cl::NDRange(0, 0, z), cl::NDRange(size_t(light_size), size_t(light_size), depth), cl::NullRange);
+        
+        copyToTexture(light_image, key.texture_ID, {0, 0, z}, {size_t(light_size), size_t(light_size), depth}, GL_RG, GL_HALF_FLOAT, 2*sizeof(cl_half));
+        
+        key.baked_slices += int(depth);
+    }
+    
+    void bakeWholeLightKey(int slot, int index) {
+        light_keys[slot].index = index;
+        light_keys[slot].baked_slices = 0;
+        bakeLightKey(slot, light_size);
+    }
+    
+    // bake the key below the light direction at both resolutions and compare them where there is density - the coarse
+    // volume is filtered at the centres of the density voxels, like the shader samples it
+    void reportLightError() {
+        int slot = findLightKey(lightKeyIndex(), true);
+        if(slot == -1 || light_size == size) return;
+        
+        glm::vec3 dir = lightDirection(lightKeyAngle(light_keys[slot].index));
+        cl_float4 light_dir = {{dir.x, dir.y, dir.z, 0.0f}};
+        
+        int sizes[2] = {size, light_size};
+        std::vector<cl_float> light[2];
+        double time[2];
+        for(int i = 0; i < 2; i++) {
+            size_t n = sizes[i];
+            cl::Image3D image(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_RG, CL_FLOAT), n, n, n);
+            generate_light.setArg(0, density_image);
+            generate_light.setArg(1, image);
+            generate_light.setArg(2, light_dir);
+            cl::Event event;
+            queue.enqueueNDRangeKernel(generate_light, cl::NullRange, cl::NDRange(n, n, n), cl::NullRange, nullptr, &event);
+            event.wait();
+            time[i] = (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-6;
             
-            CGLContextObj CGLGetCurrentContext(void);
-            CGLShareGroupObj CGLGetShareGroup(CGLContextObj);
-
-            CGLContextObj kCGLContext = CGLGetCurrentContext();
-            CGLShareGroupObj kCGLShareGroup = CGLGetShareGroup(kCGLContext);
-
-            cl_context_properties properties[] = {
-              CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE,
-              (cl_context_properties) kCGLShareGroup,
-              0
-            };
+            light[i].resize(2*n*n*n);
+            queue.enqueueReadImage(image, CL_TRUE, {0, 0, 0}, {n, n, n}, 0, 0, light[i].data());
+        }
+        
+        std::vector<cl_half> density(size_t(size)*size*size);
+        queue.enqueueReadImage(density_image, CL_TRUE, {0, 0, 0}, {size_t(size), size_t(size), size_t(size)}, 0, 0, density.data());
+        
+        // GL_LINEAR with GL_REPEAT along one axis
+        auto lerpAxis = [this](int v, int& i0, int& i1) {
+            float u = (v + 0.5f) * light_size / size - 0.5f;
+            float fl = std::floor(u);
+            i0 = (int(fl) + light_size) % light_size;
+            i1 = (i0 + 1) % light_size;
+            return u - fl;
+        };
+        
+        double squared[2] = {0.0, 0.0};
+        float max_error[2] = {0.0f, 0.0f};
+        size_t voxels = 0;
+        for(int z = 0; z < size; z++) for(int y = 0; y < size; y++) for(int x = 0; x < size; x++) {
+            size_t voxel = (size_t(z)*size + y)*size + x;
+            if(halfToFloat(density[voxel]) <= 0.0f) continue;
+            voxels++;
             
-            // https://stackoverflow.com/questions/22928704/opencl-opengl-interop-using-clcreatefromgltexture-fails-to-draw-to-texture-text
+            int i[3][2];
+            float f[3] = {lerpAxis(x, i[0][0], i[0][1]), lerpAxis(y, i[1][0], i[1][1]), lerpAxis(z, i[2][0], i[2][1])};
+            for(int c = 0; c < 2; c++) {
+                float coarse = 0.0f;
+                for(int corner = 0; corner < 8; corner++) {
+                    int a = corner & 1, b = (corner >> 1) & 1, d = (corner >> 2) & 1;
+                    float weight = (a ? f[0] : 1.0f-f[0]) * (b ? f[1] : 1.0f-f[1]) * (d ? f[2] : 1.0f-f[2]);
+                    coarse += weight * light[1][2*((size_t(i[2][d])*light_size + i[1][b])*light_size + i[0][a]) + c];
+                }
+                float error = std::fabs(coarse - light[0][2*voxel + c]);
+                squared[c] += double(error) * error;
+                max_error[c] = std::max(max_error[c], error);
+            }
+        }
+        if(voxels == 0) return;
+        
+        size_t full_bytes = size_t(size)*size*size*2*sizeof(cl_half);
+        size_t coarse_bytes = size_t(light_size)*light_size*light_size*2*sizeof(cl_half);
+        std::cout << "Clouds: light volume " << light_size << "^3 instead of " << size << "^3: bake " << time[1] << " ms instead of " << time[0] << " ms, " << coarse_bytes/1024 << " KB instead of " << full_bytes/1024 << " KB per key" << std::endl;
+        std::cout << "Clouds: light error in " << voxels << " cloud voxels: single scattering rms " << std::sqrt(squared[0] / voxels) << " max " << max_error[0] << ", multiple scattering rms " << std::sqrt(squared[1] / voxels) << " max " << max_error[1] << std::endl;
+    }
+    
+    // STAGES - each one depends on the previous one
+    
+    void generateChannels() {
+        std::mt19937 rng(seed); //random number generator
+        
+        // with more devices every one of them generates the channels of its own slabs
+        if(slabs.size() > 1) {
+            for(int m = 0; m < BASE_ITERATIONS; m++) octaveVertices(rng, m, size, base_vertices[m]);
+        } else {
+            channel_image = generateOctaves(rng, 0, BASE_ITERATIONS);
+        }
+        detail_channel_image = generateOctaves(rng, BASE_ITERATIONS, ITERATIONS);
+    }
+    
+    // the feature points of the octave m, surrounded by a layer of cells copied from the other side so that the volume tiles
+    void octaveVertices(std::mt19937& rng, int m, int octave_size, std::vector<cl_uint>* vertices) const {
+        for(int k = 0; k < CHANNELS; k++) {
+            std::uniform_int_distribution<std::mt19937::result_type> distr(0,octave_size/nodes[m][k]-1);
             
-            cl::Context context(device, properties);
-            cl::Program::Sources sources;
-            std::string kernel_code = loadSource("src/kernels/generate_3d_cloud.ocl");
-            sources.push_back({kernel_code.c_str(), kernel_code.length()});
+            int nodes_rep = nodes[m][k] + 2;
             
-            computing_program = cl::Program(context, sources);
-            if (computing_program.build({device}) != CL_SUCCESS) {
-                std::cout << "ERROR: OpenCL: CANNOT BUILD PROGRAM " << computing_program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
-                exit(-1);
+            pos*** v = new pos**[nodes_rep];
+            for(int i = 0; i < nodes_rep; i++) {
+                v[i] = new pos*[nodes_rep];
+                for(int j = 0; j < nodes_rep; j++) {
+                    v[i][j] = new pos[nodes_rep];
+                }
             }
             
+            for(int n = 1; n <= nodes[m][k]; n++) for(int j = 1; j <= nodes[m][k]; j++) for(int i = 1; i <= nodes[m][k]; i++) {
+                v[i][j][n].x = distr(rng);
+                v[i][j][n].y = distr(rng);
+                v[i][j][n].z = distr(rng);
+            }
             
+            for(int n = 0; n < nodes_rep; n++) {
+                for(int i = 0; i < nodes_rep; i++) {
+                    int j = 1+(i-1+nodes[m][k])%nodes[m][k];
+                    int u = 1+(n-1+nodes[m][k])%nodes[m][k];
+                    v[i][0][n]             = v[j][nodes[m][k]][u];
+                    v[i][nodes[m][k]+1][n] = v[j][1][u];
+                    v[0][i][n]             = v[nodes[m][k]][j][u];
+                    v[nodes[m][k]+1][i][n] = v[1][j][u];
+                    v[i][n][0]             = v[j][u][nodes[m][k]];
+                    v[i][n][nodes[m][k]+1] = v[j][u][1];
+                }
+            }
             
-            std::random_device dev;
-            std::mt19937 rng(dev()); //random number generator
+            vertices[k].assign(nodes_rep*nodes_rep*nodes_rep*4, 0);
             
-            // PREPARE THE CHANNEL DATA IMAGE
+            for(int n = 0; n < nodes_rep; n++) for(int j = 0; j < nodes_rep; j++) for(int i = 0; i < nodes_rep; i++) {
+                vertices[k][n*nodes_rep*nodes_rep*4 + j*nodes_rep*4 + i*4]     = v[i][j][n].x;
+                vertices[k][n*nodes_rep*nodes_rep*4 + j*nodes_rep*4 + i*4 + 1] = v[i][j][n].y;
+                vertices[k][n*nodes_rep*nodes_rep*4 + j*nodes_rep*4 + i*4 + 2] = v[i][j][n].y;
+            }
             
-            cl::ImageFormat image_format(CL_RGBA, CL_FLOAT);
-            cl::Image3D cloud_3D_data(context, CL_MEM_READ_WRITE, image_format, size, size, size);
+            for(int i = 0; i < nodes_rep; i++) {
+                for(int j = 0; j < nodes_rep; j++) {
+                    delete [] v[i][j];
+                }
+                delete [] v[i];
+            }
+            delete [] v;
+        }
+    }
+    
+    // the channels of the octaves first to last-1, which share the size of the volume
+    cl::Image3D generateOctaves(std::mt19937& rng, int first, int last) {
+        int octave_size = octaveSize(first);
+        
+        // PREPARE THE CHANNEL DATA IMAGE
+        
+        // an image cannot be read and written by the same kernel, so the octaves ping-pong between two of them
+        cl::ImageFormat image_format(CL_RGBA, CL_FLOAT);
+        cl::Image3D cloud_3D_data[2] = {
+            cl::Image3D(context, CL_MEM_READ_WRITE, image_format, octave_size, octave_size, octave_size),
+            cl::Image3D(context, CL_MEM_READ_WRITE, image_format, octave_size, octave_size, octave_size)
+        };
+        
+        // CALCULATE CHANNEL DATA
+        
+        cl::ImageFormat image_in_format(CL_RGBA, CL_UNSIGNED_INT32);
+        cl::Image3D vertices_image[4];
+        
+        for(int m = first; m < last; m++) {
+            std::vector<cl_uint> vertices[CHANNELS];
+            octaveVertices(rng, m, octave_size, vertices);
             
-            // CALCULATE CHANNEL DATA
+            for(int k = 0; k < CHANNELS; k++) {
+                size_t nodes_rep = nodes[m][k] + 2;
+                vertices_image[k] = cl::Image3D(context, CL_MEM_READ_ONLY, image_in_format, nodes_rep, nodes_rep, nodes_rep);
+                queue.enqueueWriteImage(vertices_image[k], CL_TRUE, {0, 0, 0}, {nodes_rep, nodes_rep, nodes_rep}, 0, 0, vertices[k].data());
+            }
+                
+            if(m == 0) {
+                tuneChannelTile(vertices_image, cloud_3D_data[(m+1)%2], cloud_3D_data[m%2]);
+            } else {
+                // octaves with finer grids may need more local memory than the tuned tile has
+                int tile = channel_tile;
+                while(tile > 0 && !tileFits(m, tile)) tile /= 2;
+                if(tile < 2 || runChannels(m, tile, vertices_image, cloud_3D_data[(m+1)%2], cloud_3D_data[m%2]) < 0.0) {
+                    runChannels(m, 0, vertices_image, cloud_3D_data[(m+1)%2], cloud_3D_data[m%2]);
+                }
+            }
+                
+            queue.finish();
+        }
+        
+        return cloud_3D_data[(last-1)%2];
+    }
+    
+    void generateCoverage() {
+        std::mt19937 rng(seed + 1); // independent of the feature points of the volume
+        
+        // the octaves ping-pong between two maps, the first one starts empty
+        std::vector<cl_float> empty(2*COVERAGE_SIZE*COVERAGE_SIZE, 0.0f);
+        cl::ImageFormat map_format(CL_RG, CL_FLOAT);
+        cl::Image2D maps[2] = {
+            cl::Image2D(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, map_format, COVERAGE_SIZE, COVERAGE_SIZE, 0, empty.data()),
+            cl::Image2D(context, CL_MEM_READ_WRITE, map_format, COVERAGE_SIZE, COVERAGE_SIZE)
+        };
+        
+        cl::Kernel generate_coverage(getProgram(COVERAGE_KERNEL_PATH, ""), "generate_coverage");
+        
+        int pass = 0;
+        for(int channel = 0; channel < 2; channel++) {
+            for(int m = 0; m < COVERAGE_OCTAVES; m++) {
+                int nodes_count = coverage_nodes[channel][m];
+                if(nodes_count == 0) continue;
+                
+                // feature points of the cells, surrounded by a ring of cells copied from the other side so that the map tiles
+                int grid_size = COVERAGE_SIZE/nodes_count;
+                int nodes_rep = nodes_count + 2;
+                std::uniform_int_distribution<int> distr(0, grid_size-1);
+                
+                std::vector<cl_uint> points(2*nodes_count*nodes_count);
+                for(cl_uint& point : points) point = distr(rng);
+                
+                std::vector<cl_uint> vertices(2*nodes_rep*nodes_rep);
+                for(int j = 0; j < nodes_rep; j++) for(int i = 0; i < nodes_rep; i++) {
+                    int cell = ((j-1+nodes_count)%nodes_count)*nodes_count + (i-1+nodes_count)%nodes_count;
+                    vertices[2*(j*nodes_rep + i)] = points[2*cell];
+                    vertices[2*(j*nodes_rep + i) + 1] = points[2*cell + 1];
+                }
+                cl::Image2D vertices_image(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, cl::ImageFormat(CL_RG, CL_UNSIGNED_INT32), nodes_rep, nodes_rep, 0, vertices.data());
+                
+                generate_coverage.setArg(0, vertices_image);
+                generate_coverage.setArg(1, maps[pass%2]);
+                generate_coverage.setArg(2, maps[(pass+1)%2]);
+                generate_coverage.setArg(3, coverage_blending[channel][m]);
+                generate_coverage.setArg(4, coverage_persistence[channel][m]);
+                generate_coverage.setArg(5, cl_int(channel));
+                queue.enqueueNDRangeKernel(generate_coverage, cl::NullRange, cl::NDRange(COVERAGE_SIZE, COVERAGE_SIZE), cl::NullRange);
+                pass++;
+            }
+        }
+        coverage_image = maps[pass%2];
+        
+        // the map is small, so it is always copied through the host
+        coverage_data.resize(2*COVERAGE_SIZE*COVERAGE_SIZE);
+        queue.enqueueReadImage(coverage_image, CL_TRUE, {0, 0, 0}, {COVERAGE_SIZE, COVERAGE_SIZE, 1}, 0, 0, coverage_data.data());
+        
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glBindTexture(GL_TEXTURE_2D, coverage_texture_ID);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, COVERAGE_SIZE, COVERAGE_SIZE, 0, GL_RG, GL_FLOAT, coverage_data.data());
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    
+    GLuint generate2DTexture() {
+        GLuint texture_ID;
+        glGenTextures(1, &texture_ID);
+        glBindTexture(GL_TEXTURE_2D, texture_ID);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        return texture_ID;
+    }
+    
+    void generateDensity() {
+        // CALCULATE DENSITY DATA
+        
+        if(density_image() == nullptr) density_image = cl::Image3D(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_HALF_FLOAT), size, size, size);
+        
+        if(slabs.size() > 1) {
+            generateDensitySlabs();
+        } else {
+            cl::Kernel generate_density(getProgram(DENSITY_KERNEL_PATH, densityOptions()), "generate_density");
             
-            cl::ImageFormat image_in_format(CL_RGBA, CL_UNSIGNED_INT32);
-            cl::Image3D vertices_image[4];
+            generate_density.setArg(0, channel_image);
+            generate_density.setArg(1, coverage_image);
+            generate_density.setArg(2, density_image);
+            queue.enqueueNDRangeKernel(generate_density, cl::NullRange, cl::NDRange(size_t(size), size_t(size), size_t(size)), cl::NullRange);
+        }
+        
+        queue.finish();
+        
+        packBricks();
+        generateDetail();
+    }
+    
+    // the channels and the density of the base volume on all the slab workers, assembled in density_image
+    // a density voxel filters the channels between its slice and the one below, so a worker generates the channels
+    // one slice below its slab - the light march needs the whole volume above a voxel, so the light stays on the selected device
+    // the images of a worker hold only a slab and its halo slice (the SLAB variants of the kernels, as in bakeOutOfCore)
+    void generateDensitySlabs() {
+        struct SlabImages {
+            cl::Image3D vertices[BASE_ITERATIONS][CHANNELS];
+            cl::Image3D channels[2];
+            cl::Image2D coverage;
+            cl::Image3D density;
+            int depth = 0; // slices of the density image
+        };
+        std::vector<SlabImages> images(slabs.size());
+        std::vector<cl_half> dense(size_t(size)*size*size);
+        
+        // the workers must not touch the map from their threads
+        const std::string& channels_code = kernel_sources[CHANNELS_KERNEL_PATH];
+        const std::string& density_code = kernel_sources[DENSITY_KERNEL_PATH];
+        
+        auto job = [&](SlabWorker& worker, int z, int depth) {
+            SlabImages& image = images[worker.id];
+            if(image.coverage() == nullptr) {
+                for(int m = 0; m < BASE_ITERATIONS; m++) for(int k = 0; k < CHANNELS; k++) {
+                    size_t nodes_rep = nodes[m][k] + 2;
+                    image.vertices[m][k] = cl::Image3D(worker.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT32), nodes_rep, nodes_rep, nodes_rep, 0, 0, base_vertices[m][k].data());
+                }
+                image.coverage = cl::Image2D(worker.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, cl::ImageFormat(CL_RG, CL_FLOAT), COVERAGE_SIZE, COVERAGE_SIZE, 0, coverage_data.data());
+            }
+            // the slabs have SLAB_DEPTH slices but the last one, so this happens once per worker
+            if(depth > image.depth) {
+                for(int i = 0; i < 2; i++) image.channels[i] = cl::Image3D(worker.context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_FLOAT), size, size, depth+1);
+                image.density = cl::Image3D(worker.context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_HALF_FLOAT), size, size, depth);
+                image.depth = depth;
+            }
             
-            cl::Kernel generate_channels(computing_program, "generate_channels");
+            // the channels of the slab start one slice below it
+            // the tiled variants take the cells of their work-group from its id, which ignores the offset
+            for(int m = 0; m < BASE_ITERATIONS; m++) {
+                cl::Kernel generate_channels(worker.getProgram(CHANNELS_KERNEL_PATH, channels_code, channelOptions(m, 0, size) + " -D SLAB"), "generate_channels");
+                for(int k = 0; k < CHANNELS; k++) generate_channels.setArg(k, image.vertices[m][k]);
+                generate_channels.setArg(CHANNELS, image.channels[(m+1)%2]);
+                generate_channels.setArg(CHANNELS+1, image.channels[m%2]);
+                worker.queue.enqueueNDRangeKernel(generate_channels, cl::NDRange(0, 0, size_t(z)), cl::NDRange(size_t(size), size_t(size), size_t(depth+1)), cl::NullRange);
+            }
             
-            for(int m = 0; m < ITERATIONS; m++) {
-                cl::CommandQueue queue(context, device);
+            cl::Kernel generate_density(worker.getProgram(DENSITY_KERNEL_PATH, density_code, densityOptions() + " -D SLAB"), "generate_density");
+            generate_density.setArg(0, image.channels[(BASE_ITERATIONS-1)%2]);
+            generate_density.setArg(1, image.coverage);
+            generate_density.setArg(2, image.density);
+            worker.queue.enqueueNDRangeKernel(generate_density, cl::NDRange(0, 0, size_t(z)), cl::NDRange(size_t(size), size_t(size), size_t(depth)), cl::NullRange);
             
-                cl_uint** vertices = new cl_uint*[CHANNELS];
-                
-                for(int k = 0; k < CHANNELS; k++) {
-                    std::uniform_int_distribution<std::mt19937::result_type> distr(0,size/nodes[m][k]-1);
-                    
-                    int nodes_rep = nodes[m][k] + 2;
-                    
-                    pos*** v = new pos**[nodes_rep];
-                    for(int i = 0; i < nodes_rep; i++) {
-                        v[i] = new pos*[nodes_rep];
-                        for(int j = 0; j < nodes_rep; j++) {
-                            v[i][j] = new pos[nodes_rep];
-                        }
-                    }
-                    
-                    for(int n = 1; n <= nodes[m][k]; n++) for(int j = 1; j <= nodes[m][k]; j++) for(int i = 1; i <= nodes[m][k]; i++) {
-                        v[i][j][n].x = distr(rng);
-                        v[i][j][n].y = distr(rng);
-                        v[i][j][n].z = distr(rng);
-                    }
-                    
-                    for(int n = 0; n < nodes_rep; n++) {
-                        for(int i = 0; i < nodes_rep; i++) {
-                            int j = 1+(i-1+nodes[m][k])%nodes[m][k];
-                            int u = 1+(n-1+nodes[m][k])%nodes[m][k];
-                            v[i][0][n]             = v[j][nodes[m][k]][u];
-                            v[i][nodes[m][k]+1][n] = v[j][1][u];
-                            v[0][i][n]             = v[nodes[m][k]][j][u];
-                            v[nodes[m][k]+1][i][n] = v[1][j][u];
-                            v[i][n][0]             = v[j][u][nodes[m][k]];
-                            v[i][n][nodes[m][k]+1] = v[j][u][1];
-                        }
-                    }
-                    
-                    vertices[k] = new cl_uint[nodes_rep*nodes_rep*nodes_rep*4];
-                    
-                    for(int n = 0; n < nodes_rep; n++) for(int j = 0; j < nodes_rep; j++) for(int i = 0; i < nodes_rep; i++) {
-                        vertices[k][n*nodes_rep*nodes_rep*4 + j*nodes_rep*4 + i*4]     = v[i][j][n].x;
-                        vertices[k][n*nodes_rep*nodes_rep*4 + j*nodes_rep*4 + i*4 + 1] = v[i][j][n].y;
-                        vertices[k][n*nodes_rep*nodes_rep*4 + j*nodes_rep*4 + i*4 + 2] = v[i][j][n].y;
-                    }
-                    
-                    for(int i = 0; i < nodes_rep; i++) {
-                        for(int j = 0; j < nodes_rep; j++) {
-                            delete [] v[i][j];
+            worker.queue.enqueueReadImage(image.density, CL_TRUE, {0, 0, 0}, {size_t(size), size_t(size), size_t(depth)}, 0, 0, &dense[size_t(z)*size*size]);
+        };
+        
+        double time = slabs.run(size, job);
+        slabs.report(time);
+        
+        // strong scaling over the first n workers, after the run above has built the programs and allocated the images
+        if(std::getenv("CLOUDS_CL_SLAB_SCALING") != nullptr) {
+            double single_time = 0.0;
+            for(size_t n = 1; n <= slabs.size(); n++) {
+                double n_time = slabs.run(size, job, n);
+                if(n == 1) single_time = n_time;
+                std::cout << "OpenCL: SLABS: SCALING: " << n << " devices: " << n_time << " ms, speedup " << single_time / n_time << ", efficiency " << int(100.0 * single_time / (n * n_time)) << "%" << std::endl;
+            }
+        }
+        
+        queue.enqueueWriteImage(density_image, CL_TRUE, {0, 0, 0}, {size_t(size), size_t(size), size_t(size)}, 0, 0, dense.data());
+    }
+    
+    // OUT OF CORE - base volumes larger than the device memory
+    
+    // slices of a slab which keep its channel and density images within OUT_OF_CORE_SLAB_BYTES, a multiple of BRICK_SIZE
+    int outOfCoreSlabDepth(int volume_size) const {
+        size_t slice = size_t(volume_size)*volume_size;
+        size_t max_alloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+        size_t depth = OUT_OF_CORE_SLAB_BYTES / (slice*(2*4*sizeof(cl_float) + sizeof(cl_half))); // two channel images and the density
+        depth = std::min(depth, std::max(max_alloc / (slice*4*sizeof(cl_float)), size_t(2)) - 1);
+        depth = std::min(depth, device.getInfo<CL_DEVICE_IMAGE3D_MAX_DEPTH>() - 1);
+        depth = std::min(depth / BRICK_SIZE * BRICK_SIZE, size_t(volume_size));
+        return int(std::max(depth, size_t(BRICK_SIZE)));
+    }
+    
+    // the channels of the detail octaves mixed into one tileable volume
+    void generateDetail() {
+        if(detail_image() == nullptr) detail_image = cl::Image3D(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_HALF_FLOAT), detail_size, detail_size, detail_size);
+        
+        cl::Kernel generate_detail(getProgram(DENSITY_KERNEL_PATH, densityOptions()), "generate_detail");
+        generate_detail.setArg(0, detail_channel_image);
+        generate_detail.setArg(1, detail_image);
+        queue.enqueueNDRangeKernel(generate_detail, cl::NullRange, cl::NDRange(size_t(detail_size), size_t(detail_size), size_t(detail_size)), cl::NullRange);
+        queue.finish();
+        
+        copyToTexture(detail_image, detail_texture_ID, {0, 0, 0}, {size_t(detail_size), size_t(detail_size), size_t(detail_size)}, GL_RED, GL_HALF_FLOAT, sizeof(cl_half));
+    }
+    
+    // the light keys are no longer valid - bake the ones around the current light direction again
+    void resetLight() {
+        generate_light = cl::Kernel(getProgram(DENSITY_KERNEL_PATH, densityOptions()), "generate_light");
+        generate_shadow = cl::Kernel(getProgram(DENSITY_KERNEL_PATH, densityOptions()), "generate_shadow");
+        shadow_angle = -1.0f;
+        
+        for(int i = 0; i < LIGHT_KEYS; i++) {
+            light_keys[i].index = -1;
+            light_keys[i].baked_slices = 0;
+        }
+        
+        updateLight();
+    }
+    
+    // EDITS - only the data which depends on the edited voxels is generated again
+    
+    // ranges (first, count) holding the texels first to last of a repeating axis of n texels
+    static std::vector<std::pair<int, int>> wrapRange(int first, int last, int n) {
+        int count = last - first + 1;
+        if(count >= n) return {{0, n}};
+        first = (first % n + n) % n;
+        if(first + count <= n) return {{first, count}};
+        return {{first, n - first}, {0, first + count - n}};
+    }
+    
+    // texel ranges along every axis of a volume of n^3 texels, centred at (i + 0.5)/n - offset, which hold the points whose march
+    // towards the light passes through the box [a, b] - the part of the volume under the box along dir, which wraps along x and z
+    static void rangesBelow(const glm::vec3& a, const glm::vec3& b, const glm::vec3& dir, int n, float offset, std::vector<std::pair<int, int>>* ranges) {
+        float t = b.y / dir.y; // from the top of the box to the bottom of the volume
+        glm::vec3 low(a.x - std::max(0.0f, t*dir.x), 0.0f, a.z - std::max(0.0f, t*dir.z));
+        glm::vec3 high(b.x - std::min(0.0f, t*dir.x), b.y, b.z - std::min(0.0f, t*dir.z));
+        
+        for(int axis = 0; axis < 3; axis++) {
+            int first = int(std::floor((low[axis] + offset) * n - 0.5f));
+            int last = int(std::ceil((high[axis] + offset) * n - 0.5f));
+            if(axis == 1) {
+                // the march ends at the top of the box
+                first = std::max(first, 0);
+                last = std::min(last, n-1);
+                ranges[axis] = {{first, last - first + 1}};
+            } else {
+                ranges[axis] = wrapRange(first, last, n);
+            }
+        }
+    }
+    
+    // find the occupied bricks among the ones holding the voxels lo to hi-1 in their aprons and copy them to the atlas again - the
+    // slots of the bricks which became empty are freed and the new bricks take free slots, all the bricks are packed again only
+    // when the atlas is full; returns the number of copied bricks
+    size_t repackBricks(const int* lo, const int* hi) {
+        int bricks = size / BRICK_SIZE;
+        size_t brick_total = size_t(bricks)*bricks*bricks;
+        cl::Program& program = getProgram(DENSITY_KERNEL_PATH, densityOptions());
+        
+        std::vector<std::pair<int, int>> ranges[3];
+        for(int axis = 0; axis < 3; axis++) ranges[axis] = wrapRange(lo[axis] > 0 ? (lo[axis]-1) / BRICK_SIZE : -1, hi[axis] / BRICK_SIZE, bricks);
+        
+        cl::Buffer occupied_buffer(context, CL_MEM_WRITE_ONLY, brick_total);
+        cl::Kernel brick_occupancy(program, "brick_occupancy");
+        brick_occupancy.setArg(0, density_image);
+        brick_occupancy.setArg(1, occupied_buffer);
+        brick_occupancy.setArg(2, cl_int(bricks));
+        for(auto& x : ranges[0]) for(auto& y : ranges[1]) for(auto& z : ranges[2]) {
+            queue.enqueueNDRangeKernel(brick_occupancy, cl::NDRange(size_t(x.first), size_t(y.first), size_t(z.first)), cl::NDRange(size_t(x.second), size_t(y.second), size_t(z.second)), cl::NullRange);
+        }
+        
+        // only the entries of the bricks above are written
+        std::vector<cl_uchar> occupied(brick_total);
+        queue.enqueueReadBuffer(occupied_buffer, CL_TRUE, 0, brick_total, occupied.data());
+        
+        std::vector<cl_uint2> entries;
+        for(auto& x : ranges[0]) for(auto& y : ranges[1]) for(auto& z : ranges[2]) {
+            for(int bz = z.first; bz < z.first + z.second; bz++) for(int by = y.first; by < y.first + y.second; by++) for(int bx = x.first; bx < x.first + x.second; bx++) {
+                size_t i = (size_t(bz)*bricks + by)*bricks + bx;
+                if(occupied[i]) {
+                    if(brick_index[i] == BRICK_EMPTY) {
+                        if(free_slots.empty()) {
+                            packBricks();
+                            return brick_total;
                         }
-                        delete [] v[i];
+                        brick_index[i] = free_slots.back();
+                        free_slots.pop_back();
                     }
-                    delete [] v;
-                    
-                    vertices_image[k] = cl::Image3D(context, CL_MEM_READ_ONLY, image_in_format, nodes_rep, nodes_rep, nodes_rep);
-                    generate_channels.setArg(k, vertices_image[k]);
-                    queue.enqueueWriteImage(vertices_image[k], CL_TRUE, {0, 0, 0}, {size_t(nodes_rep), size_t(nodes_rep), size_t(nodes_rep)}, 0, 0, vertices[k]);
+                    entries.push_back({{cl_uint(i), cl_uint(brick_index[i])}});
+                } else if(brick_index[i] != BRICK_EMPTY) {
+                    free_slots.push_back(brick_index[i]);
+                    brick_index[i] = BRICK_EMPTY;
                 }
-                
-                for(int k = 0; k < CHANNELS; k++) {
-                    delete [] vertices[k];
-                }
-                delete [] vertices;
-                    
-                cl::Buffer persistence_buff(context, CL_MEM_READ_ONLY, sizeof(cl_float)*CHANNELS);
-                cl::Buffer blending_buff(context, CL_MEM_READ_ONLY, sizeof(cl_float)*CHANNELS);
-                    
-                generate_channels.setArg(CHANNELS, persistence_buff);
-                generate_channels.setArg(CHANNELS+1, blending_buff);
-                generate_channels.setArg(CHANNELS+2, cloud_3D_data);
-                generate_channels.setArg(CHANNELS+3, cloud_3D_data);
-                    
-                queue.enqueueWriteBuffer(persistence_buff, CL_TRUE, 0, sizeof(cl_float)*CHANNELS, persistence[m]);
-                queue.enqueueWriteBuffer(blending_buff, CL_TRUE, 0, sizeof(cl_float)*CHANNELS, blending[m]);
-                    
-                queue.enqueueNDRangeKernel(generate_channels, cl::NullRange, cl::NDRange(size_t(size), size_t(size), size_t(size)), cl::NullRange);
-                    
-                // no need to do it as the GPU memory is shared between OpenCL and OpenGL now
-                //if(m == ITERATIONS-1) queue.enqueueReadImage(cloud_3D_data, CL_TRUE, {0, 0, 0}, {size_t(size), size_t(size), size_t(size)}, 0, 0, image_result);
-                
-                queue.finish();
             }
+        }
+        
+        if(!entries.empty()) {
+            cl::Buffer entries_buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, entries.size()*sizeof(cl_uint2), entries.data());
+            cl::Kernel repack_bricks(program, "repack_bricks");
+            repack_bricks.setArg(0, density_image);
+            repack_bricks.setArg(1, entries_buffer);
+            repack_bricks.setArg(2, atlas_image);
+            repack_bricks.setArg(3, cl_int(bricks));
+            queue.enqueueNDRangeKernel(repack_bricks, cl::NullRange, cl::NDRange(BRICK_APRON_SIZE, BRICK_APRON_SIZE, BRICK_APRON_SIZE*entries.size()), cl::NullRange);
             
+            std::vector<ImageRegion> regions;
+            for(const cl_uint2& entry : entries) {
+                int ax, ay, az;
+                BrickVolume::atlasPosition(entry.s[1], ax, ay, az);
+                regions.push_back({{size_t(ax*BRICK_APRON_SIZE), size_t(ay*BRICK_APRON_SIZE), size_t(az*BRICK_APRON_SIZE)}, {BRICK_APRON_SIZE, BRICK_APRON_SIZE, BRICK_APRON_SIZE}});
+            }
+            copyToTexture(atlas_image, atlas_texture_ID, regions, GL_RED, GL_HALF_FLOAT, sizeof(cl_half));
+        }
+        
+        uploadBrickIndex(ranges);
+        return entries.size();
+    }
+    
+    // bake the light of every started key again where it marches through the box [a, b], and the same part of the shadow map
+    // returns the number of light texels
+    size_t relightBelow(const glm::vec3& a, const glm::vec3& b) {
+        size_t texels = 0;
+        std::vector<std::pair<int, int>> ranges[3];
+        
+        for(int i = 0; i < LIGHT_KEYS; i++) {
+            LightKey& key = light_keys[i];
+            if(key.index < 0 || key.baked_slices == 0) continue;
             
-            // CALCULATE DENSITY AND LIGHT DATA
+            glm::vec3 dir = lightDirection(lightKeyAngle(key.index));
+            cl_float4 light_dir = {{dir.x, dir.y, dir.z, 0.0f}};
+            rangesBelow(a, b, dir, light_size, 0.5f / size, ranges);
             
-            generateGLTexture(shader);
-            cl::ImageGL image(context, CL_MEM_READ_WRITE, GL_TEXTURE_3D, 0, cloud_texture_ID);
+            // the slices the key has not reached yet will be baked from the edited density
+            std::vector<ImageRegion> regions;
+            for(auto& x : ranges[0]) for(auto& y : ranges[1]) for(auto& z : ranges[2]) {
+                int depth = std::min(z.first + z.second, key.baked_slices) - z.first;
+                if(depth > 0) regions.push_back({{size_t(x.first), size_t(y.first), size_t(z.first)}, {size_t(x.second), size_t(y.second), size_t(depth)}});
+            }
             
-            cl::Kernel generate_density(computing_program, "generate_density");
+            generate_light.setArg(0, density_image);
+            generate_light.setArg(1, light_image);
+            generate_light.setArg(2, light_dir);
+            for(const ImageRegion& r : regions) {
+                queue.enqueueNDRangeKernel(generate_light, cl::NDRange(r.origin[0], r.origin[1], r.origin[2]), cl::NDRange(r.region[0], r.region[1], r.region[2]), cl::NullRange);
+                texels += r.region[0] * r.region[1] * r.region[2];
+            }
+            copyToTexture(light_image, key.texture_ID, regions, GL_RG, GL_HALF_FLOAT, 2*sizeof(cl_half));
+        }
+        
+        // an invalid shadow map is generated whole by updateShadow
+        if(shadow_angle < 0.0f) return texels;
+        
+        glm::vec3 dir = lightDirection(shadow_angle);
+        cl_float4 light_dir = {{dir.x, dir.y, dir.z, 0.0f}};
+        rangesBelow(a, b, dir, size, 0.0f, ranges);
+        
+        generate_shadow.setArg(0, density_image);
+        generate_shadow.setArg(1, shadow_image);
+        generate_shadow.setArg(2, light_dir);
+        
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glBindTexture(GL_TEXTURE_2D, shadow_texture_ID);
+        for(auto& x : ranges[0]) for(auto& z : ranges[2]) {
+            queue.enqueueNDRangeKernel(generate_shadow, cl::NDRange(size_t(x.first), size_t(z.first)), cl::NDRange(size_t(x.second), size_t(z.second)), cl::NullRange);
             
-            cl::CommandQueue queue(context, device);
+            std::vector<cl_half> shadow(size_t(x.second)*z.second);
+            queue.enqueueReadImage(shadow_image, CL_TRUE, {size_t(x.first), size_t(z.first), 0}, {size_t(x.second), size_t(z.second), 1}, 0, 0, shadow.data());
+            glTexSubImage2D(GL_TEXTURE_2D, 0, x.first, z.first, x.second, z.second, GL_RED, GL_HALF_FLOAT, shadow.data());
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        
+        return texels;
+    }
+    
+public:
+    Clouds(Shader& shader) {
+        locateUniforms(shader);
+        
+        try {
+            compute_device = selectComputeDevice();
+            device = compute_device.device;
             
-            generate_density.setArg(0, cloud_3D_data);
-            generate_density.setArg(1, image);
-            queue.enqueueNDRangeKernel(generate_density, cl::NullRange, cl::NDRange(size_t(size), size_t(size), size_t(size)), cl::NullRange);
+            // OpenCl - OpenGL interop
+            // https://stackoverflow.com/questions/22928704/opencl-opengl-interop-using-clcreatefromgltexture-fails-to-draw-to-texture-text
             
-            queue.finish();
+            context = createComputeContext(compute_device);
+            queue = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+            
+            std::cout << "SUCCESS: OpenCL: USING A DEVICE: " << compute_device.name << (compute_device.gl_sharing ? " (shared with OpenGL)" : " (staged copies to OpenGL)") << std::endl;
+            
+            slabs.addWorker(compute_device.name, context, device, queue);
+            for(const ComputeDevice& slab_device : selectSlabDevices(compute_device)) slabs.addDevice(slab_device);
+            if(slabs.size() > 1) std::cout << "OpenCL: THE BASE VOLUME IS SPLIT INTO SLABS ACROSS " << slabs.size() << " DEVICES" << std::endl;
+            
+            std::random_device dev;
+            seed = dev();
+            
+            if(!loadSource(CHANNELS_KERNEL_PATH, kernel_sources[CHANNELS_KERNEL_PATH]) || !loadSource(DENSITY_KERNEL_PATH, kernel_sources[DENSITY_KERNEL_PATH]) || !loadSource(COVERAGE_KERNEL_PATH, kernel_sources[COVERAGE_KERNEL_PATH])) {
+                exit(-1); //stop executing the program with the error code -1;
+            }
+            
+            generateChannels();
+            
+            coverage_texture_ID = generate2DTexture();
+            generateCoverage();
+            
+            atlas_texture_ID = generateAtlasTextures();
+            detail_texture_ID = generateGLTexture(GL_R16F, GL_RED, detail_size);
+            generateDensity();
+            
+            for(int i = 0; i < LIGHT_KEYS; i++) light_keys[i].texture_ID = generateGLTexture(GL_RG16F, GL_RG, light_size);
+            light_image = cl::Image3D(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_RG, CL_HALF_FLOAT), light_size, light_size, light_size);
+            shadow_texture_ID = generate2DTexture();
+            shadow_image = cl::Image2D(context, CL_MEM_WRITE_ONLY, cl::ImageFormat(CL_R, CL_HALF_FLOAT), size, size);
+            resetLight();
+            
+            // a second bake at the full resolution, so only on request
+            if(std::getenv("CLOUDS_CL_LIGHT_ERROR") != nullptr) reportLightError();
             
         } catch(cl::Error e) {
             std::cerr << "ERROR: OpenCL: OTHER: " << e.what() << ": " << e.err() << std::endl;
-            if(e.err() == CL_BUILD_PROGRAM_FAILURE) {
-                std::cerr << "ERROR: OpenCL: CANNOT BUILD PROGRAM: " << computing_program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
-            } else std::cerr << "USE:\nhttps://streamhpc.com/blog/2013-04-28/opencl-error-codes\nTO VERIFY ERROR TYPE" << std::endl;
+            if(e.err() != CL_BUILD_PROGRAM_FAILURE) std::cerr << "USE:\nhttps://streamhpc.com/blog/2013-04-28/opencl-error-codes\nTO VERIFY ERROR TYPE" << std::endl;
             exit(-1);
         }
     }
     
-    void transferData() {
+    ~Clouds() {
+        shared_textures.clear();
+        if(staging_buffer != 0) glDeleteBuffers(1, &staging_buffer);
+        glDeleteTextures(1, &atlas_texture_ID);
+        glDeleteTextures(1, &brick_index_texture_ID);
+        glDeleteTextures(1, &coverage_texture_ID);
+        glDeleteTextures(1, &detail_texture_ID);
+        glDeleteTextures(1, &shadow_texture_ID);
+        for(int i = 0; i < LIGHT_KEYS; i++) glDeleteTextures(1, &light_keys[i].texture_ID);
+    }
+    
+    // has to be called again after the cloud shader is reloaded
+    void locateUniforms(Shader& shader) {
+        texture_loc = shader.location("density_sampler");
+        brick_index_loc = shader.location("brick_index");
+        coverage_loc = shader.location("coverage_sampler");
+        detail_loc = shader.location("detail_sampler");
+        light_loc[0] = shader.location("light_sampler_a");
+        light_loc[1] = shader.location("light_sampler_b");
+        light_blend_loc = shader.location("light_blend");
+    }
+    
+    bool usesFile(const std::string& path) const {
+        return kernel_sources.count(path) != 0;
+    }
+    
+    // rebuild the kernels of a changed file and re-run only the stages which depend on it
+    // if the new code does not build, the last good programs and the generated data are kept
+    void reloadKernels(const std::string& path) {
+        if(!usesFile(path)) return;
+        
+        std::string code;
+        if(!loadSource(path, code) || code == kernel_sources[path]) return;
+        
+        std::string last_code = kernel_sources[path];
+        std::map<std::string, cl::Program> last_programs = programs;
+        
+        kernel_sources[path] = code;
+        for(auto it = programs.begin(); it != programs.end();) {
+            if(it->first.compare(0, path.length()+1, path + "|") == 0) it = programs.erase(it);
+            else ++it;
+        }
+        slabs.clearPrograms(path);
+        
+        try {
+            if(path == CHANNELS_KERNEL_PATH) generateChannels();
+            if(path == COVERAGE_KERNEL_PATH) generateCoverage();
+            generateDensity();
+            resetLight();
+            std::cout << "SUCCESS: OpenCL: RELOADED " << path << std::endl;
+        } catch(cl::Error e) {
+            std::cerr << "ERROR: OpenCL: CANNOT RELOAD " << path << ": " << e.what() << ": " << e.err() << ", KEEPING THE LAST GOOD PROGRAM" << std::endl;
+            kernel_sources[path] = last_code;
+            programs = last_programs;
+            slabs.clearPrograms(path);
+        }
+    }
+    
+    // the light moves over an arc with the azimuth of the original light direction (0.5, 1.0, -0.3)
+    static glm::vec3 lightDirection(float angle) {
+        return glm::normalize(glm::vec3(0.8575f*cos(angle), sin(angle), -0.5145f*cos(angle)));
+    }
+    
+    glm::vec3 lightDirection() const {
+        return lightDirection(light_angle);
+    }
+    
+    void setLightAngle(float angle) {
+        angle = std::max(light_angle_min, std::min(angle, lightKeyAngle(lightKeyCount()-1)));
+        if(angle != light_angle) light_rising = angle > light_angle;
+        light_angle = angle;
+    }
+    
+    // make sure the two keys around the light direction are baked and bake a part of the key the light moves towards
+    void updateLight() {
+        try {
+            int index = lightKeyIndex();
+            
+            // the light has jumped over the prepared key - bake the missing ones at once
+            for(int i = index; i <= index+1; i++) {
+                if(findLightKey(i, true) == -1) {
+                    int slot = findLightKey(i, false);
+                    if(slot == -1) slot = freeLightKey(index);
+                    bakeWholeLightKey(slot, i);
+                }
+            }
+            
+            int next = light_rising ? index+2 : index-1;
+            if(next < 0 || next >= lightKeyCount() || findLightKey(next, true) != -1) return;
+            
+            int slot = findLightKey(next, false);
+            if(slot == -1) {
+                slot = freeLightKey(index);
+                light_keys[slot].index = next;
+                light_keys[slot].baked_slices = 0;
+            }
+            bakeLightKey(slot, light_slices_per_update);
+        } catch(cl::Error e) {
+            std::cerr << "ERROR: OpenCL: CANNOT BAKE THE LIGHT: " << e.what() << ": " << e.err() << std::endl;
+        }
+    }
+    
+    // one march from every texel of the bottom of the box to the top, only when the light has moved or the density has changed
+    // the map is in the frame of the density, the object shader moves it with the clouds
+    void updateShadow() {
+        if(light_angle == shadow_angle) return;
+        
+        try {
+            glm::vec3 dir = lightDirection();
+            cl_float4 light_dir = {{dir.x, dir.y, dir.z, 0.0f}};
+            
+            generate_shadow.setArg(0, density_image);
+            generate_shadow.setArg(1, shadow_image);
+            generate_shadow.setArg(2, light_dir);
+            queue.enqueueNDRangeKernel(generate_shadow, cl::NullRange, cl::NDRange(size_t(size), size_t(size)), cl::NullRange);
+            
+            // the map is small, so it is always copied through the host
+            std::vector<cl_half> shadow(size_t(size)*size);
+            queue.enqueueReadImage(shadow_image, CL_TRUE, {0, 0, 0}, {size_t(size), size_t(size), 1}, 0, 0, shadow.data());
+            
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glBindTexture(GL_TEXTURE_2D, shadow_texture_ID);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, size, size, 0, GL_RED, GL_HALF_FLOAT, shadow.data());
+            glBindTexture(GL_TEXTURE_2D, 0);
+            
+            shadow_angle = light_angle;
+        } catch(cl::Error e) {
+            std::cerr << "ERROR: OpenCL: CANNOT GENERATE THE CLOUD SHADOW: " << e.what() << ": " << e.err() << std::endl;
+        }
+    }
+    
+    // the object shaders sample the shadow map from this unit
+    void bindShadow() const {
+        glActiveTexture(GL_TEXTURE0 + CLOUD_SHADOW_UNIT);
+        glBindTexture(GL_TEXTURE_2D, shadow_texture_ID);
         glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_3D, cloud_texture_ID);
+    }
+    
+    void transferData(FrameData& frame) const {
+        frame.light_dir = lightDirection();
+    }
+    
+    void transferData(Shader& shader) {
+        int index = lightKeyIndex();
+        
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_3D, atlas_texture_ID);
         glUniform1i(texture_loc, 0);
+        
+        glActiveTexture(GL_TEXTURE5);
+        glBindTexture(GL_TEXTURE_3D, brick_index_texture_ID);
+        glUniform1i(brick_index_loc, 5);
+        
+        glActiveTexture(GL_TEXTURE6);
+        glBindTexture(GL_TEXTURE_2D, coverage_texture_ID);
+        glUniform1i(coverage_loc, 6);
+        
+        glActiveTexture(GL_TEXTURE7);
+        glBindTexture(GL_TEXTURE_3D, detail_texture_ID);
+        glUniform1i(detail_loc, 7);
+        
+        for(int i = 0; i < 2; i++) {
+            glActiveTexture(GL_TEXTURE2 + i);
+            int slot = findLightKey(index+i, true);
+            glBindTexture(GL_TEXTURE_3D, slot != -1 ? light_keys[slot].texture_ID : 0);
+            glUniform1i(light_loc[i], 2 + i);
+        }
+        
+        glUniform1f(light_blend_loc, (light_angle - lightKeyAngle(index)) / light_key_step);
+        
+        glActiveTexture(GL_TEXTURE0);
+    }
+    
+    // generate the base volume at volume_size^3 into a brick volume file, for offline use - only the channels of one slab and
+    // its halo slice are on the device, the slabs are written to the mapped file while the next one is generated
+    // the shape comes from the same seed and coverage map as the real-time volume, with the feature points of a larger grid
+    bool bakeOutOfCore(int volume_size, const std::string& path) {
+        // the cells of every base channel have to tile the volume exactly, or the wrapped feature points leave a seam
+        int multiple = BRICK_SIZE;
+        for(int m = 0; m < BASE_ITERATIONS; m++) for(int k = 0; k < CHANNELS; k++) {
+            int a = multiple, b = nodes[m][k];
+            while(b != 0) {
+                int r = a % b;
+                a = b;
+                b = r;
+            }
+            multiple = multiple / a * nodes[m][k];
+        }
+        if(volume_size <= 0 || volume_size % multiple != 0 || size_t(volume_size) > device.getInfo<CL_DEVICE_IMAGE3D_MAX_WIDTH>()) {
+            std::cerr << "ERROR: Clouds: CANNOT BAKE A VOLUME OF SIZE " << volume_size << ", IT HAS TO BE A MULTIPLE OF " << multiple << " AND FIT INTO A 3D IMAGE" << std::endl;
+            return false;
+        }
+        
+        BrickVolumeWriter writer;
+        if(!writer.open(path, volume_size)) return false;
+        
+        auto start = std::chrono::steady_clock::now();
+        int depth = outOfCoreSlabDepth(volume_size);
+        size_t n = volume_size;
+        
+        try {
+            std::mt19937 rng(seed);
+            cl::Kernel generate_channels[BASE_ITERATIONS];
+            cl::Image3D vertices_image[BASE_ITERATIONS][CHANNELS];
+            for(int m = 0; m < BASE_ITERATIONS; m++) {
+                std::vector<cl_uint> vertices[CHANNELS];
+                octaveVertices(rng, m, volume_size, vertices);
+                for(int k = 0; k < CHANNELS; k++) {
+                    size_t nodes_rep = nodes[m][k] + 2;
+                    vertices_image[m][k] = cl::Image3D(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT32), nodes_rep, nodes_rep, nodes_rep, 0, 0, vertices[k].data());
+                }
+                generate_channels[m] = cl::Kernel(getProgram(CHANNELS_KERNEL_PATH, channelOptions(m, 0, volume_size) + " -D SLAB"), "generate_channels");
+            }
+            cl::Kernel generate_density(getProgram(DENSITY_KERNEL_PATH, densityOptions() + " -D SLAB"), "generate_density");
+            
+            // the channels of a slab start one slice below it
+            cl::Image3D channels[2] = {
+                cl::Image3D(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_FLOAT), n, n, depth+1),
+                cl::Image3D(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_FLOAT), n, n, depth+1)
+            };
+            cl::Image3D density(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_HALF_FLOAT), n, n, depth);
+            
+            // one slab is read back while the one before it is written
+            std::vector<cl_half> slabs[2] = {std::vector<cl_half>(n*n*depth), std::vector<cl_half>(n*n*depth)};
+            std::future<void> writing;
+            
+            for(int z = 0, i = 0; z < volume_size; z += depth, i++) {
+                size_t slab_depth = std::min(depth, volume_size - z);
+                
+                for(int m = 0; m < BASE_ITERATIONS; m++) {
+                    for(int k = 0; k < CHANNELS; k++) generate_channels[m].setArg(k, vertices_image[m][k]);
+                    generate_channels[m].setArg(CHANNELS, channels[(m+1)%2]);
+                    generate_channels[m].setArg(CHANNELS+1, channels[m%2]);
+                    queue.enqueueNDRangeKernel(generate_channels[m], cl::NDRange(0, 0, size_t(z)), cl::NDRange(n, n, slab_depth+1), cl::NullRange);
+                }
+                
+                generate_density.setArg(0, channels[(BASE_ITERATIONS-1)%2]);
+                generate_density.setArg(1, coverage_image);
+                generate_density.setArg(2, density);
+                queue.enqueueNDRangeKernel(generate_density, cl::NDRange(0, 0, size_t(z)), cl::NDRange(n, n, slab_depth), cl::NullRange);
+                
+                std::vector<cl_half>& slab = slabs[i%2];
+                queue.enqueueReadImage(density, CL_TRUE, {0, 0, 0}, {n, n, slab_depth}, 0, 0, slab.data());
+                
+                if(writing.valid()) writing.get();
+                writing = std::async(std::launch::async, [&writer, &slab, z, slab_depth] {
+                    writer.writeSlab(z, int(slab_depth), slab.data());
+                });
+            }
+            if(writing.valid()) writing.get();
+        } catch(cl::Error e) {
+            std::cerr << "ERROR: OpenCL: CANNOT BAKE THE VOLUME: " << e.what() << ": " << e.err() << std::endl;
+            writer.abort();
+            return false;
+        }
+        
+        size_t brick_count = writer.brickCount();
+        writer.close();
+        
+        double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        size_t device_bytes = n*n*((depth+1)*2*4*sizeof(cl_float) + depth*sizeof(cl_half));
+        size_t file_bytes = sizeof(BrickVolumeHeader) + size_t(volume_size/BRICK_SIZE)*(volume_size/BRICK_SIZE)*(volume_size/BRICK_SIZE)*sizeof(uint32_t) + brick_count*BrickVolume::brick_voxels*sizeof(uint16_t);
+        std::cout << "Clouds: baked " << volume_size << "^3 in slabs of " << depth << " slices to " << path << " in " << time << " s: " << brick_count << " bricks, " << (file_bytes >> 20) << " MB, " << (device_bytes >> 20) << " MB on the device" << std::endl;
+        return true;
+    }
+    
+    // the occupied bricks without their aprons, to be saved for other tools
+    void exportBricks(BrickVolume& volume) {
+        volume = BrickVolume(size);
+        
+        // the edits leave the slots out of the order of the dense grid, the file stores the bricks in that order
+        std::vector<uint32_t> slots;
+        for(size_t i = 0; i < brick_index.size(); i++) {
+            if(brick_index[i] == BRICK_EMPTY) continue;
+            volume.index[i] = uint32_t(slots.size());
+            slots.push_back(brick_index[i]);
+        }
+        if(slots.empty()) return;
+        
+        std::vector<cl_half> atlas(atlas_size[0]*atlas_size[1]*atlas_size[2]);
+        queue.enqueueReadImage(atlas_image, CL_TRUE, {0, 0, 0}, {atlas_size[0], atlas_size[1], atlas_size[2]}, 0, 0, atlas.data());
+        
+        volume.data.resize(slots.size() * BrickVolume::brick_voxels);
+        for(size_t brick = 0; brick < slots.size(); brick++) {
+            int ax, ay, az;
+            BrickVolume::atlasPosition(slots[brick], ax, ay, az);
+            for(int z = 0; z < BRICK_SIZE; z++) for(int y = 0; y < BRICK_SIZE; y++) {
+                size_t row = (size_t(az*BRICK_APRON_SIZE + z + 1)*atlas_size[1] + ay*BRICK_APRON_SIZE + y + 1)*atlas_size[0] + ax*BRICK_APRON_SIZE + 1;
+                std::copy(&atlas[row], &atlas[row] + BRICK_SIZE, &volume.data[(brick*BRICK_SIZE + z)*BRICK_SIZE*BRICK_SIZE + y*BRICK_SIZE]);
+            }
+        }
+    }
+    
+    // replace the generated density with a baked volume - it has to have the size of the generated one
+    bool importBricks(const BrickVolume& volume) {
+        if(volume.size != size) {
+            std::cerr << "ERROR: Clouds: CANNOT IMPORT A VOLUME OF SIZE " << volume.size << ", THE CLOUDS HAVE SIZE " << size << std::endl;
+            return false;
+        }
+        
+        try {
+            std::vector<uint16_t> dense;
+            volume.toDenseHalf(dense);
+            queue.enqueueWriteImage(density_image, CL_TRUE, {0, 0, 0}, {size_t(size), size_t(size), size_t(size)}, 0, 0, dense.data());
+            packBricks();
+            resetLight();
+        } catch(cl::Error e) {
+            std::cerr << "ERROR: OpenCL: CANNOT IMPORT THE VOLUME: " << e.what() << ": " << e.err() << std::endl;
+            return false;
+        }
+        return true;
+    }
+    
+    // replace the generated density with a larger baked volume, like the out of core one, box filtered to the size of the clouds
+    bool importBricks(const MappedBrickVolume& volume) {
+        if(volume.size() < size) {
+            std::cerr << "ERROR: Clouds: CANNOT DOWNSAMPLE A VOLUME OF SIZE " << volume.size() << " TO THE SIZE OF THE CLOUDS " << size << std::endl;
+            return false;
+        }
+        
+        auto start = std::chrono::steady_clock::now();
+        try {
+            std::vector<uint16_t> dense;
+            volume.downsampleHalf(size, dense);
+            queue.enqueueWriteImage(density_image, CL_TRUE, {0, 0, 0}, {size_t(size), size_t(size), size_t(size)}, 0, 0, dense.data());
+            packBricks();
+            resetLight();
+        } catch(cl::Error e) {
+            std::cerr << "ERROR: OpenCL: CANNOT IMPORT THE VOLUME: " << e.what() << ": " << e.err() << std::endl;
+            return false;
+        }
+        
+        double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Clouds: imported " << volume.brickCount() << " bricks of a " << volume.size() << "^3 volume in " << time << " s" << std::endl;
+        return true;
+    }
+    
+    // apply a brush to the density and update only what depends on the voxels it touched: their bricks, the texels of the light
+    // keys and of the shadow map below them along the light, so the time grows with the size of the brush and not of the volume
+    // the brush is clipped to the box, it does not wrap around like the textures - returns false if nothing was edited
+    bool editDensity(const DensityBrush& brush) {
+        int lo[3], hi[3];
+        cl::array<size_t, 3> origin, region;
+        for(int axis = 0; axis < 3; axis++) {
+            float extent = std::max(brush.extent[axis], 0.5f / size);
+            lo[axis] = std::max(0, int(std::floor((brush.center[axis] - extent) * size)));
+            hi[axis] = std::min(size, int(std::ceil((brush.center[axis] + extent) * size)));
+            if(lo[axis] >= hi[axis]) return false;
+            origin[axis] = size_t(lo[axis]);
+            region[axis] = size_t(hi[axis] - lo[axis]);
+        }
+        
+        auto start = std::chrono::steady_clock::now();
+        
+        try {
+            // the kernel reads the density from a copy of the region
+            cl::Image3D density_copy(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_HALF_FLOAT), region[0], region[1], region[2]);
+            queue.enqueueCopyImage(density_image, density_copy, origin, {0, 0, 0}, region);
+            
+            glm::vec3 extent = glm::max(brush.extent, glm::vec3(0.5f / size));
+            cl::Kernel edit_density(getProgram(DENSITY_KERNEL_PATH, densityOptions()), "edit_density");
+            edit_density.setArg(0, density_copy);
+            edit_density.setArg(1, detail_image);
+            edit_density.setArg(2, density_image);
+            edit_density.setArg(3, cl_int(brush.shape));
+            edit_density.setArg(4, cl_float4{{brush.center.x, brush.center.y, brush.center.z, 0.0f}});
+            edit_density.setArg(5, cl_float4{{extent.x, extent.y, extent.z, 1.0f}});
+            edit_density.setArg(6, cl_float(brush.amount));
+            edit_density.setArg(7, cl_float(std::max(brush.softness, 0.001f)));
+            edit_density.setArg(8, cl_float(brush.noise));
+            queue.enqueueNDRangeKernel(edit_density, cl::NDRange(origin[0], origin[1], origin[2]), cl::NDRange(region[0], region[1], region[2]), cl::NullRange);
+            
+            size_t repacked = repackBricks(lo, hi);
+            
+            // the filtered samples read the edited voxels half a voxel around them
+            glm::vec3 a = (glm::vec3(lo[0], lo[1], lo[2]) - 0.5f) / float(size);
+            glm::vec3 b = (glm::vec3(hi[0], hi[1], hi[2]) + 0.5f) / float(size);
+            size_t relit = relightBelow(a, b);
+            queue.finish();
+            
+            double time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "Clouds: edited " << region[0]*region[1]*region[2] << " voxels, copied " << repacked << " bricks and relit " << relit << " light texels in " << time << " ms" << std::endl;
+        } catch(cl::Error e) {
+            std::cerr << "ERROR: OpenCL: CANNOT EDIT THE DENSITY: " << e.what() << ": " << e.err() << std::endl;
+            return false;
+        }
+        return true;
+    }
+    
+    // copy the volumes the cloud shader samples this frame back from the GPU, for the CPU raymarcher
+    void readVolume(CloudVolume& volume) {
+        int index = lightKeyIndex();
+        size_t light_voxels = size_t(light_size)*light_size*light_size;
+        
+        volume.size = size;
+        volume.light_size = light_size;
+        volume.light_a.resize(2*light_voxels);
+        volume.light_b.resize(2*light_voxels);
+        volume.light_blend = (light_angle - lightKeyAngle(index)) / light_key_step;
+        
+        BrickVolume bricks;
+        exportBricks(bricks);
+        bricks.toDense(volume.density);
+        
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        
+        volume.detail_size = detail_size;
+        volume.detail.resize(size_t(detail_size)*detail_size*detail_size);
+        glBindTexture(GL_TEXTURE_3D, detail_texture_ID);
+        glGetTexImage(GL_TEXTURE_3D, 0, GL_RED, GL_FLOAT, volume.detail.data());
+        glBindTexture(GL_TEXTURE_3D, 0);
+        
+        volume.coverage_size = COVERAGE_SIZE;
+        volume.coverage.resize(COVERAGE_SIZE*COVERAGE_SIZE);
+        glBindTexture(GL_TEXTURE_2D, coverage_texture_ID);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, volume.coverage.data());
+        glBindTexture(GL_TEXTURE_2D, 0);
+        
+        std::vector<float>* light[2] = {&volume.light_a, &volume.light_b};
+        for(int i = 0; i < 2; i++) {
+            int slot = findLightKey(index+i, true);
+            if(slot == -1) {
+                std::fill(light[i]->begin(), light[i]->end(), 0.0f);
+                continue;
+            }
+            glBindTexture(GL_TEXTURE_3D, light_keys[slot].texture_ID);
+            glGetTexImage(GL_TEXTURE_3D, 0, GL_RG, GL_FLOAT, light[i]->data());
+        }
+        glBindTexture(GL_TEXTURE_3D, 0);
     }
     
 };
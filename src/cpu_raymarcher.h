@@ -0,0 +1,438 @@
+//
+//  cpu_raymarcher.h
+//  Clouds
+//
+//  CPU version of the cloud march in clouds_fast.fs - the reference the GPU frames are compared with,
+//  and a renderer for machines without a GPU. It has to be kept in step with the shader.
+//
+
+#ifndef cpu_raymarcher_h
+#define cpu_raymarcher_h
+
+#define RAY_PACKET 4 // neighbouring rays marched together, they read the same parts of the volumes
+#define RAYMARCH_TILE 32 // edge of the image tiles handed to the threads
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <future>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "glm.hpp"
+
+#include "frame_uniforms.h"
+#include "thread_pool.h"
+
+// the density and the two light volumes around the light direction, x varies the fastest like in the GL textures
+struct CloudVolume {
+    int size = 0;
+    std::vector<float> density; // size^3
+    int light_size = 0; // of the light volumes, a fraction of size
+    std::vector<float> light_a; // light_size^3 pairs: single scattering, multiple scattering
+    std::vector<float> light_b;
+    float light_blend = 0.0f;
+    int coverage_size = 0; // 0 - no coverage map
+    std::vector<float> coverage; // coverage_size^2, channel R of the coverage map
+    int detail_size = 0; // 0 - no detail volume
+    std::vector<float> detail; // detail_size^3
+
+    bool valid() const {
+        size_t voxels = size_t(size)*size*size;
+        size_t light_voxels = size_t(light_size)*light_size*light_size;
+        return size > 0 && light_size > 0 && density.size() == voxels && light_a.size() == 2*light_voxels && light_b.size() == 2*light_voxels && coverage.size() == size_t(coverage_size)*coverage_size && detail.size() == size_t(detail_size)*detail_size*detail_size;
+    }
+
+    // raw dump, so that the reference can be rendered where the volumes cannot be generated - see renderOffline in main.cpp
+    bool save(const std::string& path) const {
+        std::ofstream file(path, std::ios::out | std::ios::binary);
+        if(!file || !valid()) {
+            std::cerr << "ERROR: CLOUD VOLUME: CANNOT SAVE: " << path << std::endl;
+            return false;
+        }
+        file.write((const char*)&size, sizeof(size));
+        file.write((const char*)&light_blend, sizeof(light_blend));
+        file.write((const char*)&light_size, sizeof(light_size));
+        file.write((const char*)density.data(), density.size()*sizeof(float));
+        file.write((const char*)light_a.data(), light_a.size()*sizeof(float));
+        file.write((const char*)light_b.data(), light_b.size()*sizeof(float));
+        file.write((const char*)&coverage_size, sizeof(coverage_size));
+        file.write((const char*)coverage.data(), coverage.size()*sizeof(float));
+        file.write((const char*)&detail_size, sizeof(detail_size));
+        file.write((const char*)detail.data(), detail.size()*sizeof(float));
+        return bool(file);
+    }
+
+    bool load(const std::string& path) {
+        std::ifstream file(path, std::ios::in | std::ios::binary);
+        if(file) {
+            file.read((char*)&size, sizeof(size));
+            file.read((char*)&light_blend, sizeof(light_blend));
+            file.read((char*)&light_size, sizeof(light_size));
+        }
+        if(!file || size <= 0 || size > 2048 || light_size <= 0 || light_size > size) {
+            std::cerr << "ERROR: CLOUD VOLUME: CANNOT LOAD: " << path << std::endl;
+            size = 0;
+            return false;
+        }
+        size_t voxels = size_t(size)*size*size;
+        size_t light_voxels = size_t(light_size)*light_size*light_size;
+        density.resize(voxels);
+        light_a.resize(2*light_voxels);
+        light_b.resize(2*light_voxels);
+        file.read((char*)density.data(), density.size()*sizeof(float));
+        file.read((char*)light_a.data(), light_a.size()*sizeof(float));
+        file.read((char*)light_b.data(), light_b.size()*sizeof(float));
+        file.read((char*)&coverage_size, sizeof(coverage_size));
+        if(file && coverage_size >= 0 && coverage_size <= 16384) {
+            coverage.resize(size_t(coverage_size)*coverage_size);
+            file.read((char*)coverage.data(), coverage.size()*sizeof(float));
+        }
+        file.read((char*)&detail_size, sizeof(detail_size));
+        if(file && detail_size >= 0 && detail_size <= 1024) {
+            detail.resize(size_t(detail_size)*detail_size*detail_size);
+            file.read((char*)detail.data(), detail.size()*sizeof(float));
+        }
+        if(!file || !valid()) {
+            std::cerr << "ERROR: CLOUD VOLUME: TRUNCATED FILE: " << path << std::endl;
+            size = 0;
+            return false;
+        }
+        return true;
+    }
+};
+
+// the camera and the light of a reference frame, saved next to its volume
+inline bool saveFrameData(const std::string& path, const FrameData& frame) {
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    if(file) file.write((const char*)&frame, sizeof(frame));
+    if(!file) {
+        std::cerr << "ERROR: CLOUD VOLUME: CANNOT SAVE THE FRAME: " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+inline bool loadFrameData(const std::string& path, FrameData& frame) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if(file) file.read((char*)&frame, sizeof(frame));
+    if(!file) {
+        std::cerr << "ERROR: CLOUD VOLUME: CANNOT LOAD THE FRAME: " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+class CloudRaymarcher {
+private:
+    // the constants of clouds_fast.fs, see cloud_constants.h
+    const float sample_sep = CLOUD_SAMPLE_SEP;
+    const float sample_sep_blank = CLOUD_SAMPLE_SEP_BLANK;
+    const float box_size = CLOUD_BOX_SIZE;
+    const float main_ray_absorbtion = CLOUD_MAIN_RAY_ABSORBTION;
+    const float brightness_amplify = CLOUD_BRIGHTNESS_AMPLIFY;
+    const float multi_scatter_strength = CLOUD_MULTI_SCATTER_STRENGTH;
+    const float coverage_low = CLOUD_COVERAGE_LOW;
+    const float detail_band = CLOUD_DETAIL_BAND;
+    const float detail_strength = CLOUD_DETAIL_STRENGTH;
+
+    const glm::vec3 light_col = glm::vec3(CLOUD_LIGHT_COL);
+    const glm::vec3 no_light_col = glm::vec3(CLOUD_NO_LIGHT_COL);
+    const glm::vec3 bottom_col = glm::vec3(CLOUD_BOTTOM_COL);
+    const glm::vec3 top_col = glm::vec3(CLOUD_TOP_COL);
+    const glm::vec3 moon_col = glm::vec3(CLOUD_MOON_COL);
+
+    const CloudVolume& volume;
+    ThreadPool* pool;
+
+    int width = 0, height = 0;
+    std::vector<glm::vec3> pixels;
+    float detail_scale = CLOUD_DETAIL_SCALE; // of the frame being rendered
+
+    // a packet of rays in structure of arrays form - the samples are gathered lane by lane, the steps of all the lanes
+    // are plain arithmetic over the arrays without branches
+    struct RayPacket {
+        float dir_x[RAY_PACKET], dir_y[RAY_PACKET], dir_z[RAY_PACKET];
+        float param[RAY_PACKET], param_max[RAY_PACKET], dist[RAY_PACKET], dist_in_box[RAY_PACKET];
+        float sub_dist[RAY_PACKET], sub_dist_blank[RAY_PACKET];
+        float transmittance[RAY_PACKET], brightness[RAY_PACKET];
+        float sample[RAY_PACKET], light[RAY_PACKET];
+        float point_x[RAY_PACKET], point_y[RAY_PACKET], point_z[RAY_PACKET];
+        bool active[RAY_PACKET];
+    };
+
+    // texel corners and weights of GL_LINEAR filtering with GL_REPEAT wrapping
+    struct Trilinear {
+        size_t index[8];
+        float weight[8];
+    };
+
+    Trilinear trilinear(float x, float y, float z, int n) const {
+        float u[3] = {x*n - 0.5f, y*n - 0.5f, z*n - 0.5f};
+        int i0[3], i1[3];
+        float f[3];
+        for(int k = 0; k < 3; k++) {
+            float fl = std::floor(u[k]);
+            f[k] = u[k] - fl;
+            int i = int(fl) % n;
+            if(i < 0) i += n;
+            i0[k] = i;
+            i1[k] = i+1 == n ? 0 : i+1;
+        }
+
+        Trilinear t;
+        for(int c = 0; c < 8; c++) {
+            int ix = c & 1 ? i1[0] : i0[0];
+            int iy = c & 2 ? i1[1] : i0[1];
+            int iz = c & 4 ? i1[2] : i0[2];
+            t.index[c] = (size_t(iz)*n + iy)*n + ix;
+            t.weight[c] = (c & 1 ? f[0] : 1.0f-f[0]) * (c & 2 ? f[1] : 1.0f-f[1]) * (c & 4 ? f[2] : 1.0f-f[2]);
+        }
+        return t;
+    }
+
+    // bilinear, repeating like the coverage texture
+    float sampleCoverage(float x, float z) const {
+        const int n = volume.coverage_size;
+        float u = x*n - 0.5f, v = z*n - 0.5f;
+        float fu = std::floor(u), fv = std::floor(v);
+        int i0 = int(fu) % n, j0 = int(fv) % n;
+        if(i0 < 0) i0 += n;
+        if(j0 < 0) j0 += n;
+        int i1 = i0+1 == n ? 0 : i0+1;
+        int j1 = j0+1 == n ? 0 : j0+1;
+        float a = u - fu, b = v - fv;
+        const std::vector<float>& c = volume.coverage;
+        return (1.0f-b) * ((1.0f-a)*c[size_t(j0)*n + i0] + a*c[size_t(j0)*n + i1]) + b * ((1.0f-a)*c[size_t(j1)*n + i0] + a*c[size_t(j1)*n + i1]);
+    }
+
+    // erodeDensity of the shader - the detail is sampled only near the edges of the clouds
+    float erodeDensity(float base, const RayPacket& p, int l) const {
+        if(volume.detail_size == 0 || base <= 0.0f || base >= detail_band) return base;
+
+        Trilinear t = trilinear(p.point_x[l] * detail_scale, p.point_y[l] * detail_scale, p.point_z[l] * detail_scale, volume.detail_size);
+        float detail = 0.0f;
+        for(int c = 0; c < 8; c++) detail += t.weight[c] * volume.detail[t.index[c]];
+
+        float edge = 1.0f - base / detail_band;
+        return std::max(0.0f, base - (1.0f - detail) * edge * detail_band * detail_strength);
+    }
+
+    // densityAt of the shader - nothing where the coverage map is below its threshold
+    float densityAt(RayPacket& p, int l) const {
+        if(volume.coverage_size > 0 && sampleCoverage(p.point_x[l], p.point_z[l]) <= coverage_low) return 0.0f;
+        Trilinear t = trilinear(p.point_x[l], p.point_y[l], p.point_z[l], volume.size);
+        return erodeDensity(sampleDensity(t), p, l);
+    }
+
+    float sampleDensity(const Trilinear& t) const {
+        float value = 0.0f;
+        for(int c = 0; c < 8; c++) value += t.weight[c] * volume.density[t.index[c]];
+        return value;
+    }
+
+    // single scattering transmittance plus the baked multiple scattering octaves, filtered in the coarser light volumes
+    float sampleLight(const RayPacket& p, int l) const {
+        Trilinear t = trilinear(p.point_x[l], p.point_y[l], p.point_z[l], volume.light_size);
+        float a_x = 0.0f, a_y = 0.0f, b_x = 0.0f, b_y = 0.0f;
+        for(int c = 0; c < 8; c++) {
+            a_x += t.weight[c] * volume.light_a[2*t.index[c]];
+            a_y += t.weight[c] * volume.light_a[2*t.index[c]+1];
+            b_x += t.weight[c] * volume.light_b[2*t.index[c]];
+            b_y += t.weight[c] * volume.light_b[2*t.index[c]+1];
+        }
+        float x = a_x + (b_x - a_x) * volume.light_blend;
+        float y = a_y + (b_y - a_y) * volume.light_blend;
+        return x + y * multi_scatter_strength;
+    }
+
+    glm::vec3 calculateBackground(const glm::vec3& dir, const glm::vec3& light_dir) const {
+        float angle = 0.5f+0.5f*glm::dot(dir, -light_dir);
+
+        if(angle > 0.001f) {
+            glm::vec3 color = glm::mix(top_col, bottom_col, angle*angle);
+            float halo = std::exp(-angle*angle*300000.0f);
+            return glm::mix(color, moon_col, halo);
+        } else return moon_col;
+    }
+
+    // the sample points of the active lanes, at the current ray parameters
+    void samplePoints(RayPacket& p, const FrameData& frame) const {
+        const float size_inv = 1.0f / box_size;
+        const glm::vec3 shift = frame.cloud_velocity * frame.time;
+        for(int l = 0; l < RAY_PACKET; l++) {
+            p.point_x[l] = (frame.origin.x + p.dir_x[l]*p.param[l]) * size_inv + shift.x;
+            p.point_y[l] = (frame.origin.y + p.dir_y[l]*p.param[l]) * size_inv + shift.y;
+            p.point_z[l] = (frame.origin.z + p.dir_z[l]*p.param[l]) * size_inv + shift.z;
+        }
+    }
+
+    void addSample(RayPacket& p, int l) const {
+        float dens_step = p.sample[l] * p.sub_dist[l] / box_size;
+        p.brightness[l] += dens_step * sampleLight(p, l) * p.transmittance[l];
+        p.transmittance[l] *= std::exp(-dens_step * main_ray_absorbtion);
+    }
+
+    // genInitialRay, distInBox and the march of main() for RAY_PACKET neighbouring pixels
+    void marchPacket(const FrameData& frame, int x, int y, int lanes) {
+        RayPacket p;
+        const glm::vec3 normal = glm::normalize(glm::cross(frame.vertical, frame.horizontal));
+        const glm::vec3 box_end(box_size);
+
+        for(int l = 0; l < RAY_PACKET; l++) {
+            // the lanes past the end of the row repeat its last pixel
+            float s = (std::min(x+l, x+lanes-1) + 0.5f) / width;
+            float t = (y + 0.5f) / height;
+            glm::vec3 dir = glm::normalize(frame.camera_llc + s*frame.horizontal + t*frame.vertical);
+            p.dir_x[l] = dir.x;
+            p.dir_y[l] = dir.y;
+            p.dir_z[l] = dir.z;
+
+            glm::vec3 t1 = (glm::vec3(0.0f) - frame.origin) / dir;
+            glm::vec3 t2 = (box_end - frame.origin) / dir;
+            glm::vec3 t_min = glm::min(t1, t2);
+            glm::vec3 t_max = glm::max(t1, t2);
+            float param1 = std::max(std::max(t_min.x, t_min.y), t_min.z);
+            float param2 = std::min(t_max.x, std::min(t_max.y, t_max.z));
+            float dist_to_box = std::max(0.0f, param1);
+
+            p.param[l] = dist_to_box;
+            p.dist_in_box[l] = std::max(0.0f, param2 - dist_to_box);
+            p.param_max[l] = dist_to_box + p.dist_in_box[l];
+            p.dist[l] = 0.0f;
+            p.transmittance[l] = 1.0f;
+            p.brightness[l] = 0.0f;
+
+            float inv_cos_angle = 1.0f / glm::dot(dir, normal);
+            p.sub_dist[l] = sample_sep * inv_cos_angle;
+            p.sub_dist_blank[l] = sample_sep_blank * inv_cos_angle;
+            p.active[l] = p.dist_in_box[l] > 0.0f;
+        }
+
+        // the lanes advance independently and leave the packet once they are out of the box or opaque
+        bool any_active = true;
+        while(any_active) {
+            samplePoints(p, frame);
+            for(int l = 0; l < RAY_PACKET; l++) {
+                p.sample[l] = p.active[l] ? densityAt(p, l) : 0.0f;
+                p.light[l] = p.sample[l] > 0.0f ? sampleLight(p, l) : 0.0f;
+            }
+
+            // masked by the lanes: an empty sample leaves the light unchanged, a lane out of the packet does not move
+            any_active = false;
+            for(int l = 0; l < RAY_PACKET; l++) {
+                float dens_step = p.sample[l] * p.sub_dist[l] / box_size;
+                p.brightness[l] += dens_step * p.light[l] * p.transmittance[l];
+                p.transmittance[l] *= std::exp(-dens_step * main_ray_absorbtion);
+
+                float step = p.sample[l] > 0.0f ? p.sub_dist[l] : p.sub_dist_blank[l];
+                step = p.active[l] ? step : 0.0f;
+                p.param[l] += step;
+                p.dist[l] += step;
+
+                p.active[l] = p.active[l] & (p.transmittance[l] > 0.01f) & (p.dist[l] <= p.dist_in_box[l]);
+                any_active |= p.active[l];
+            }
+        }
+
+        // the last sample at the exit point of the box
+        for(int l = 0; l < RAY_PACKET; l++) p.param[l] = p.param_max[l];
+        samplePoints(p, frame);
+
+        for(int l = 0; l < lanes; l++) {
+            glm::vec3 dir(p.dir_x[l], p.dir_y[l], p.dir_z[l]);
+            glm::vec3 final_col(0.0f);
+
+            if(p.dist_in_box[l] > 0.0f) {
+                p.sample[l] = densityAt(p, l);
+                addSample(p, l);
+                final_col = no_light_col + light_col * p.brightness[l] * brightness_amplify;
+            }
+
+            pixels[size_t(y)*width + x + l] = glm::mix(final_col, calculateBackground(dir, frame.light_dir), p.transmittance[l]);
+        }
+    }
+
+    void renderTile(const FrameData& frame, int tile) {
+        int tiles_x = (width + RAYMARCH_TILE - 1) / RAYMARCH_TILE;
+        int x0 = (tile % tiles_x) * RAYMARCH_TILE;
+        int y0 = (tile / tiles_x) * RAYMARCH_TILE;
+        int x1 = std::min(x0 + RAYMARCH_TILE, width);
+        int y1 = std::min(y0 + RAYMARCH_TILE, height);
+
+        for(int y = y0; y < y1; y++) {
+            for(int x = x0; x < x1; x += RAY_PACKET) marchPacket(frame, x, y, std::min(RAY_PACKET, x1 - x));
+        }
+    }
+
+public:
+    // the volume has to outlive the raymarcher
+    CloudRaymarcher(const CloudVolume& volume, ThreadPool* pool = nullptr) : volume(volume), pool(pool) {}
+
+    // render the cloud pass (without the scene objects) of the frame described by the FrameData block
+    bool render(const FrameData& frame, int render_width, int render_height) {
+        if(!volume.valid() || render_width <= 0 || render_height <= 0) {
+            std::cerr << "ERROR: CPU RAYMARCHER: NOTHING TO RENDER" << std::endl;
+            return false;
+        }
+        width = render_width;
+        height = render_height;
+        detail_scale = frame.detail_scale;
+        pixels.assign(size_t(width)*height, glm::vec3(0.0f));
+
+        int tile_count = ((width + RAYMARCH_TILE - 1) / RAYMARCH_TILE) * ((height + RAYMARCH_TILE - 1) / RAYMARCH_TILE);
+        std::atomic<int> next_tile(0);
+        auto work = [this, &frame, &next_tile, tile_count] {
+            for(int tile = next_tile++; tile < tile_count; tile = next_tile++) renderTile(frame, tile);
+        };
+
+        // the tiles are taken in order by every worker, the calling thread takes its share too
+        std::vector<std::future<void>> workers;
+        size_t worker_count = pool != nullptr ? pool->size() : 0;
+        for(size_t i = 0; i < worker_count; i++) workers.push_back(pool->submit(work));
+        work();
+        for(std::future<void>& worker : workers) worker.get();
+
+        return true;
+    }
+
+    int imageWidth() const {
+        return width;
+    }
+
+    int imageHeight() const {
+        return height;
+    }
+
+    // linear colour of the cloud pass, the bottom row first like in the GL framebuffers
+    const std::vector<glm::vec3>& image() const {
+        return pixels;
+    }
+
+    // uncompressed TGA like Screen::takeScreenshot
+    bool saveTGA(const std::string& path) const {
+        std::ofstream file(path, std::ios::out | std::ios::binary);
+        if(!file || pixels.empty()) {
+            std::cerr << "ERROR: CPU RAYMARCHER: CANNOT SAVE THE IMAGE: " << path << std::endl;
+            return false;
+        }
+
+        short TGA_header[] = {0, 2, 0, 0, 0, 0, short(width), short(height), 24};
+        std::vector<uint8_t> pixel_data(3*pixels.size());
+        for(size_t i = 0; i < pixels.size(); i++) {
+            glm::vec3 color = glm::clamp(pixels[i], 0.0f, 1.0f) * 255.0f + 0.5f;
+            pixel_data[3*i] = uint8_t(color.b);
+            pixel_data[3*i+1] = uint8_t(color.g);
+            pixel_data[3*i+2] = uint8_t(color.r);
+        }
+
+        file.write((char*)TGA_header, 9*sizeof(short));
+        file.write((char*)pixel_data.data(), pixel_data.size());
+        return bool(file);
+    }
+};
+
+#endif /* cpu_raymarcher_h */
@@ -0,0 +1,114 @@
+//
+//  file_watcher.h
+//  Clouds
+//
+//  Reports the watched files that were written since the last poll - inotify on Linux, modification times elsewhere.
+//
+
+#ifndef file_watcher_h
+#define file_watcher_h
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+class FileWatcher {
+private:
+    std::map<std::string, time_t> files; // path -> last modification time
+
+#if defined(__linux__)
+    int fd = -1;
+    std::map<int, std::string> directories; // watch descriptor -> directory with the trailing '/'
+#endif
+
+    static time_t modificationTime(const std::string& path) {
+        struct stat info;
+        if(stat(path.c_str(), &info) != 0) return 0;
+        return info.st_mtime;
+    }
+
+    static std::string directoryOf(const std::string& path) {
+        size_t slash = path.find_last_of('/');
+        return slash == std::string::npos ? "./" : path.substr(0, slash + 1);
+    }
+
+public:
+    FileWatcher() {
+#if defined(__linux__)
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if(fd < 0) std::cerr << "ERROR: FILE WATCHER: INOTIFY UNAVAILABLE, POLLING MODIFICATION TIMES" << std::endl;
+#endif
+    }
+
+    ~FileWatcher() {
+#if defined(__linux__)
+        if(fd >= 0) close(fd);
+#endif
+    }
+
+    FileWatcher(const FileWatcher&) = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
+
+    void watch(const std::string& path) {
+        if(files.count(path)) return;
+        files[path] = modificationTime(path);
+
+#if defined(__linux__)
+        if(fd < 0) return;
+
+        // editors usually replace the file instead of writing it, so the directory is watched
+        std::string directory = directoryOf(path);
+        for(auto& d : directories) if(d.second == directory) return;
+
+        int wd = inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+        if(wd < 0) std::cerr << "ERROR: FILE WATCHER: CANNOT WATCH " << directory << std::endl;
+        else directories[wd] = directory;
+#endif
+    }
+
+    // the paths (as passed to watch) changed since the last call - cheap enough to call every frame
+    std::vector<std::string> poll() {
+        std::vector<std::string> changed;
+
+#if defined(__linux__)
+        if(fd >= 0) {
+            alignas(struct inotify_event) char buffer[4096];
+            ssize_t length;
+            while((length = read(fd, buffer, sizeof(buffer))) > 0) {
+                for(char* ptr = buffer; ptr < buffer + length; ptr += sizeof(struct inotify_event) + ((struct inotify_event*)ptr)->len) {
+                    struct inotify_event* event = (struct inotify_event*)ptr;
+                    if(event->len == 0 || !directories.count(event->wd)) continue;
+
+                    std::string path = directories[event->wd] + event->name;
+                    if(directories[event->wd] == "./") path = event->name;
+
+                    if(files.count(path) && std::find(changed.begin(), changed.end(), path) == changed.end()) changed.push_back(path);
+                }
+            }
+            for(const std::string& path : changed) files[path] = modificationTime(path);
+            return changed;
+        }
+#endif
+
+        for(auto& file : files) {
+            time_t time = modificationTime(file.first);
+            if(time != 0 && time != file.second) {
+                file.second = time;
+                changed.push_back(file.first);
+            }
+        }
+        return changed;
+    }
+};
+
+#endif /* file_watcher_h */
@@ -0,0 +1,85 @@
+//
+//  frame_uniforms.h
+//  Clouds
+//
+//  Per-frame state shared by all the programs through one std140 uniform buffer.
+//
+
+#ifndef frame_uniforms_h
+#define frame_uniforms_h
+
+#include <GL/glew.h>
+#include "glm.hpp"
+
+#include "shader.h"
+#include "cloud_constants.h"
+
+// mirrors the FrameData block declared in the shaders:
+// layout(std140) uniform FrameData {
+//     mat4 PV;
+//     vec3 origin;
+//     float time;
+//     vec3 camera_llc;
+//     vec3 horizontal;
+//     vec3 vertical;
+//     vec3 light_dir;
+//     float near_plane;
+//     float far_plane;
+//     float detail_scale;
+//     vec3 cloud_velocity;
+// };
+// every vec3 occupies 16 bytes in std140, the padding floats keep the offsets equal
+struct FrameData {
+    glm::mat4 PV;         // camera relative projection * view
+    glm::vec3 origin;     // camera position
+    float time;
+    glm::vec3 camera_llc; // camera's lower left corner direction
+    float pad_0;
+    glm::vec3 horizontal;
+    float pad_1;
+    glm::vec3 vertical;
+    float pad_2;
+    glm::vec3 light_dir;
+    float near_plane;     // of the PV matrix
+    float far_plane;
+    float detail_scale = CLOUD_DETAIL_SCALE;
+    float pad_3[2];
+    glm::vec3 cloud_velocity = CLOUD_VELOCITY;
+    float pad_4;
+};
+
+static_assert(sizeof(FrameData) == 176, "FrameData does not match the std140 layout");
+
+class FrameUniforms {
+private:
+    GLuint UBO;
+
+public:
+    FrameData data;
+
+    FrameUniforms() : data() {
+        glGenBuffers(1, &UBO);
+        glBindBuffer(GL_UNIFORM_BUFFER, UBO);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+        // Shader binds its FrameData block to this point when it links
+        glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_DATA_BINDING, UBO);
+    }
+
+    ~FrameUniforms() {
+        glDeleteBuffers(1, &UBO);
+    }
+
+    FrameUniforms(const FrameUniforms&) = delete;
+    FrameUniforms& operator=(const FrameUniforms&) = delete;
+
+    // upload the whole block once per frame, before anything is drawn
+    void update() {
+        glBindBuffer(GL_UNIFORM_BUFFER, UBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &data);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+};
+
+#endif /* frame_uniforms_h */
@@ -0,0 +1,154 @@
+//
+//  instanced_object.h
+//  Clouds
+//
+//  Many copies of one model drawn with a single call per mesh. The instances are culled against
+//  the camera frustum on the CPU and the visible model matrices are streamed into an instance buffer.
+//
+
+#ifndef instanced_object_h
+#define instanced_object_h
+
+#include <vector>
+#include <algorithm>
+
+#include <GL/glew.h>
+#include "glm.hpp"
+#include "gtc/matrix_transform.hpp"
+
+#include "model.h"
+#include "shader.h"
+#include "camera.h"
+#include "thread_pool.h"
+
+class InstancedObject {
+private:
+    Shader shader;
+
+    Model model;
+
+    std::vector<glm::mat4> transforms;
+
+    // bounding spheres in the world space, kept as separate arrays so that the culling loop vectorises
+    std::vector<float> center_x, center_y, center_z, radius;
+    bool bounds_dirty = true;
+
+    std::vector<float> distance; // to the nearest frustum plane, negative if the sphere is outside
+    std::vector<glm::mat4> visible;
+
+    unsigned int instance_VBO;
+    size_t instance_capacity = 0;
+
+    GLint shadow_loc;
+    GLint radiance_loc, irradiance_loc;
+
+    void updateBounds() {
+        size_t count = transforms.size();
+        center_x.resize(count);
+        center_y.resize(count);
+        center_z.resize(count);
+        radius.resize(count);
+
+        for(size_t i = 0; i < count; i++) {
+            const glm::mat4& M = transforms[i];
+            glm::vec3 center = glm::vec3(M * glm::vec4(model.bounds_center, 1.0f));
+            float scale = std::max(glm::length(glm::vec3(M[0])), std::max(glm::length(glm::vec3(M[1])), glm::length(glm::vec3(M[2]))));
+
+            center_x[i] = center.x;
+            center_y[i] = center.y;
+            center_z[i] = center.z;
+            radius[i] = model.bounds_radius * scale;
+        }
+        bounds_dirty = false;
+    }
+
+    // keep the instances whose bounding spheres touch the frustum of the camera relative PV matrix
+    void cull(const glm::mat4& PV, const glm::vec3& camera_pos) {
+        // frustum planes (Gribb, Hartmann), pointing inwards
+        glm::vec4 planes[6];
+        for(int i = 0; i < 3; i++) {
+            planes[2*i] = glm::vec4(PV[0][3] + PV[0][i], PV[1][3] + PV[1][i], PV[2][3] + PV[2][i], PV[3][3] + PV[3][i]);
+            planes[2*i+1] = glm::vec4(PV[0][3] - PV[0][i], PV[1][3] - PV[1][i], PV[2][3] - PV[2][i], PV[3][3] - PV[3][i]);
+        }
+        for(glm::vec4& plane : planes) {
+            plane /= glm::length(glm::vec3(plane));
+            // move the planes from the camera relative into the world space
+            plane.w -= glm::dot(glm::vec3(plane), camera_pos);
+        }
+
+        size_t count = transforms.size();
+        distance.assign(count, INFINITY);
+        for(const glm::vec4& plane : planes) {
+            const float px = plane.x, py = plane.y, pz = plane.z, pw = plane.w;
+            for(size_t i = 0; i < count; i++) {
+                distance[i] = std::min(distance[i], px*center_x[i] + py*center_y[i] + pz*center_z[i] + pw + radius[i]);
+            }
+        }
+
+        visible.clear();
+        for(size_t i = 0; i < count; i++) {
+            if(distance[i] >= 0.0f) visible.push_back(transforms[i]);
+        }
+    }
+
+    void uploadInstances() {
+        glBindBuffer(GL_ARRAY_BUFFER, instance_VBO);
+        instance_capacity = std::max(visible.size(), instance_capacity);
+        glBufferData(GL_ARRAY_BUFFER, instance_capacity * sizeof(glm::mat4), NULL, GL_STREAM_DRAW); // orphan the storage of the last frame
+        glBufferSubData(GL_ARRAY_BUFFER, 0, visible.size() * sizeof(glm::mat4), visible.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    
+public:
+    InstancedObject(const char* model_path, const char* obj_vertex_path, const char* obj_fragment_path, ThreadPool* pool = nullptr) : shader(obj_vertex_path, obj_fragment_path), model(model_path, false, pool) {
+        glGenBuffers(1, &instance_VBO);
+        shadow_loc = shader.location("cloud_shadow");
+        radiance_loc = shader.location("sky_radiance");
+        irradiance_loc = shader.location("sky_irradiance");
+    }
+
+    ~InstancedObject() {
+        glDeleteBuffers(1, &instance_VBO);
+    }
+
+    InstancedObject(const InstancedObject&) = delete;
+    InstancedObject& operator=(const InstancedObject&) = delete;
+
+    // the model matrix of the new instance in the world space
+    size_t addInstance(const glm::mat4& M) {
+        transforms.push_back(M);
+        bounds_dirty = true;
+        return transforms.size() - 1;
+    }
+
+    void setInstance(size_t index, const glm::mat4& M) {
+        transforms[index] = M;
+        bounds_dirty = true;
+    }
+
+    size_t instanceCount() const {
+        return transforms.size();
+    }
+
+    size_t visibleCount() const {
+        return visible.size();
+    }
+
+    // the camera and the light are taken from the FrameData block
+    void render(Camera& camera) {
+        if(!model.upload() || transforms.empty()) return;
+        if(bounds_dirty) updateBounds();
+
+        cull(camera.transferPVMatrix(), camera.transferPos());
+        if(visible.empty()) return;
+        uploadInstances();
+
+        shader.use();
+        shader.setInt(shadow_loc, CLOUD_SHADOW_UNIT);
+        shader.setInt(radiance_loc, SKY_RADIANCE_UNIT);
+        shader.setInt(irradiance_loc, SKY_IRRADIANCE_UNIT);
+        model.drawInstanced(shader, instance_VBO, (int)visible.size());
+    }
+};
+
+#endif /* instanced_object_h */
@@ -0,0 +1,171 @@
+//
+//  mapped_file.h
+//  Clouds
+//
+//  A file of a fixed size mapped to the memory. The pages are written back by the system, so a file
+//  larger than the memory can be filled part by part.
+//
+
+#ifndef mapped_file_h
+#define mapped_file_h
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+class MappedFile {
+private:
+    uint8_t* data = nullptr;
+    size_t bytes = 0;
+    bool writable = false;
+
+    #if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+    #else
+    int file = -1;
+    #endif
+
+public:
+    MappedFile() {}
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    // create (or replace) a file of the given size, the unwritten parts read as zeros
+    bool create(const std::string& path, size_t size) {
+        close();
+        writable = true;
+        bytes = size;
+
+        #if defined(_WIN32)
+        file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if(file != INVALID_HANDLE_VALUE) mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, DWORD(uint64_t(size) >> 32), DWORD(size), NULL);
+        if(mapping != NULL) data = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+        #else
+        file = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(file != -1 && ftruncate(file, off_t(size)) == 0) {
+            void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+            if(mapped != MAP_FAILED) data = (uint8_t*)mapped;
+        }
+        #endif
+
+        if(data == nullptr) {
+            std::cerr << "ERROR: MAPPED FILE: CANNOT CREATE: " << path << " OF " << (size >> 20) << " MB" << std::endl;
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    bool open(const std::string& path) {
+        close();
+        writable = false;
+
+        #if defined(_WIN32)
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        LARGE_INTEGER size;
+        if(file != INVALID_HANDLE_VALUE && GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+            bytes = size_t(size.QuadPart);
+            mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        }
+        if(mapping != NULL) data = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        #else
+        file = ::open(path.c_str(), O_RDONLY);
+        off_t size = file != -1 ? lseek(file, 0, SEEK_END) : 0;
+        if(size > 0) {
+            bytes = size_t(size);
+            void* mapped = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, file, 0);
+            if(mapped != MAP_FAILED) data = (uint8_t*)mapped;
+        }
+        #endif
+
+        if(data == nullptr) {
+            std::cerr << "ERROR: MAPPED FILE: CANNOT OPEN: " << path << std::endl;
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    // unmap the file, a written file can be cut to its used part
+    void close(size_t used = SIZE_MAX) {
+        if(data != nullptr) {
+            #if defined(_WIN32)
+            if(writable) FlushViewOfFile(data, 0);
+            UnmapViewOfFile(data);
+            #else
+            if(writable) msync(data, bytes, MS_SYNC);
+            munmap(data, bytes);
+            #endif
+        }
+        data = nullptr;
+
+        #if defined(_WIN32)
+        if(mapping != NULL) CloseHandle(mapping);
+        mapping = NULL;
+        if(file != INVALID_HANDLE_VALUE) {
+            if(writable && used < bytes) {
+                LARGE_INTEGER end;
+                end.QuadPart = LONGLONG(used);
+                SetFilePointerEx(file, end, NULL, FILE_BEGIN);
+                SetEndOfFile(file);
+            }
+            CloseHandle(file);
+        }
+        file = INVALID_HANDLE_VALUE;
+        #else
+        if(file != -1) {
+            if(writable && used < bytes && ftruncate(file, off_t(used)) != 0) std::cerr << "ERROR: MAPPED FILE: CANNOT TRUNCATE" << std::endl;
+            ::close(file);
+        }
+        file = -1;
+        #endif
+
+        bytes = 0;
+    }
+
+    // start writing back the given part, without waiting for it
+    void flush(size_t offset, size_t size) {
+        if(data == nullptr || !writable) return;
+        #if defined(_WIN32)
+        FlushViewOfFile(data + offset, size);
+        #else
+        // msync needs a page aligned start
+        size_t page = size_t(sysconf(_SC_PAGESIZE));
+        size_t start = offset / page * page;
+        msync(data + start, offset + size - start, MS_ASYNC);
+        #endif
+    }
+
+    uint8_t* begin() {
+        return data;
+    }
+
+    const uint8_t* begin() const {
+        return data;
+    }
+
+    size_t size() const {
+        return bytes;
+    }
+
+    bool isOpen() const {
+        return data != nullptr;
+    }
+};
+
+#endif /* mapped_file_h */
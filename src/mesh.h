@@ -11,6 +11,7 @@
 #include "gtc/matrix_transform.hpp"
 
 #include "shader.h"
+#include "staging_buffer.h"
 
 #include <string>
 #include <fstream>
@@ -34,29 +35,95 @@ struct Texture {
 
 class Mesh {
 public:
-    std::vector<Vertex> vertices;
+    std::vector<Vertex> vertices; // emptied after the upload unless the mesh keeps its data
     std::vector<unsigned int> indices;
     std::vector<Texture> textures;
     unsigned int VAO;
     
-    Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices, std::vector<Texture> textures) {
-        this->vertices = vertices;
-        this->indices = indices;
-        this->textures = textures;
-
-        setupMesh();
+    Mesh(std::vector<Vertex>&& vertices, std::vector<unsigned int>&& indices, std::vector<Texture>&& textures, bool keep_data = false, StagingBuffer* staging = nullptr) : vertices(std::move(vertices)), indices(std::move(indices)), textures(std::move(textures)) {
+        setupMesh(this->vertices.data(), this->vertices.size(), this->indices.data(), this->indices.size(), GL_UNSIGNED_INT, staging);
+        
+        if(!keep_data) {
+            std::vector<Vertex>().swap(this->vertices);
+            std::vector<unsigned int>().swap(this->indices);
+        }
+    }
+    
+    // upload straight from the memory of a mesh cache - no CPU side copy is kept
+    Mesh(const Vertex* vertex_data, size_t vertex_count, const void* index_data, size_t index_count, GLenum index_type, std::vector<Texture>&& textures, StagingBuffer* staging = nullptr) : textures(std::move(textures)) {
+        setupMesh(vertex_data, vertex_count, index_data, index_count, index_type, staging);
+    }
+    
+    // memory held on the CPU side and in the vertex and index buffers
+    size_t residentBytes() const {
+        return vertices.capacity() * sizeof(Vertex) + indices.capacity() * sizeof(unsigned int);
+    }
+    
+    size_t bufferBytes() const {
+        return vertex_count * sizeof(Vertex) + index_count * (index_type == GL_UNSIGNED_SHORT ? 2 : 4);
+    }
+    
+    void draw(Shader& shader) {
+        if(sampler_program != shader.ID) locateSamplers(shader);
+        
+        for(unsigned int i = 0; i < textures.size(); i++) {
+            glActiveTexture(GL_TEXTURE0 + i);
+            glUniform1i(sampler_locs[i], i);
+            glBindTexture(GL_TEXTURE_2D, textures[i].ID);
+        }
+        
+        glBindVertexArray(VAO);
+        glDrawElements(GL_TRIANGLES, (GLsizei)index_count, index_type, 0);
+        glBindVertexArray(0);
+        
+        glActiveTexture(GL_TEXTURE0);
+    }
+    // per-instance model matrices are read from the buffer at the attributes 5 - 8
+    void setInstanceBuffer(unsigned int instance_VBO) {
+        glBindVertexArray(VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, instance_VBO);
+        for(int i = 0; i < 4; i++) {
+            glEnableVertexAttribArray(5 + i);
+            glVertexAttribPointer(5 + i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(i * sizeof(glm::vec4)));
+            glVertexAttribDivisor(5 + i, 1);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
     }
     
-    void draw(Shader shader) {
+    void drawInstanced(Shader& shader, int instance_count) {
+        if(sampler_program != shader.ID) locateSamplers(shader);
         
+        for(unsigned int i = 0; i < textures.size(); i++) {
+            glActiveTexture(GL_TEXTURE0 + i);
+            glUniform1i(sampler_locs[i], i);
+            glBindTexture(GL_TEXTURE_2D, textures[i].ID);
+        }
+        
+        glBindVertexArray(VAO);
+        glDrawElementsInstanced(GL_TRIANGLES, (GLsizei)index_count, index_type, 0, instance_count);
+        glBindVertexArray(0);
+        
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+private:
+    unsigned int VBO, EBO;
+    size_t vertex_count, index_count;
+    GLenum index_type; // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+    
+    // sampler locations of the textures for the program they were looked up in
+    std::vector<GLint> sampler_locs;
+    unsigned int sampler_program = 0;
+    
+    void locateSamplers(Shader& shader) {
         unsigned int diffuseNr = 1;
         unsigned int specularNr = 1;
         unsigned int normalNr = 1;
         unsigned int heightNr = 1;
         
+        sampler_locs.resize(textures.size());
         for(unsigned int i = 0; i < textures.size(); i++) {
-            glActiveTexture(GL_TEXTURE0 + i);
-            
             std::string number;
             std::string type = textures[i].type;
             if(type == "texture_diffuse") number = std::to_string(diffuseNr++);
@@ -64,29 +131,27 @@ public:
             else if(type == "texture_normal") number = std::to_string(normalNr++);
             else if(type == "texture_height") number = std::to_string(heightNr++);
             
-            glUniform1i(glGetUniformLocation(shader.ID, (type + number).c_str()), i);
-            glBindTexture(GL_TEXTURE_2D, textures[i].ID);
+            sampler_locs[i] = shader.location(type + number);
         }
-        
-        glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
-        
-        glActiveTexture(GL_TEXTURE0);
+        sampler_program = shader.ID;
     }
-private:
-    unsigned int VBO, EBO;
     
-    void setupMesh() {
+    void setupMesh(const Vertex* vertex_data, size_t vertex_count, const void* index_data, size_t index_count, GLenum index_type, StagingBuffer* staging) {
+        this->vertex_count = vertex_count;
+        this->index_count = index_count;
+        this->index_type = index_type;
+        
         glGenVertexArrays(1, &VAO);
         glGenBuffers(1, &VBO);
         glGenBuffers(1, &EBO);
         
         glBindVertexArray(VAO);
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
+        if(staging != nullptr) staging->bufferData(GL_ARRAY_BUFFER, vertex_data, vertex_count * sizeof(Vertex));
+        else glBufferData(GL_ARRAY_BUFFER, vertex_count * sizeof(Vertex), vertex_data, GL_STATIC_DRAW);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+        if(staging != nullptr) staging->bufferData(GL_ELEMENT_ARRAY_BUFFER, index_data, index_count * (index_type == GL_UNSIGNED_SHORT ? 2 : 4));
+        else glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_count * (index_type == GL_UNSIGNED_SHORT ? 2 : 4), index_data, GL_STATIC_DRAW);
         
         glEnableVertexAttribArray(0);
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
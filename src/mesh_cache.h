@@ -0,0 +1,260 @@
+//
+//  mesh_cache.h
+//  Clouds
+//
+//  Binary cache of the models loaded through Assimp: interleaved vertices, 16 or 32 bit indices,
+//  the material table and the decoded textures, mapped straight into memory at startup.
+//  The file is written next to the source (<model>.cache) and used while its hash matches the OBJ.
+//
+
+#ifndef mesh_cache_h
+#define mesh_cache_h
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+#if defined(_WIN32)
+#include <iterator>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "mesh.h"
+
+#define MESH_CACHE_VERSION 1
+#define MESH_CACHE_MAX_TEXTURES 8 // per mesh
+#define MESH_CACHE_ALIGNMENT 16
+
+// the layout is native - the cache is not meant to be moved between machines
+struct MeshCacheHeader {
+    char magic[4]; // "CLMC"
+    uint32_t version;
+    uint64_t source_hash;
+    uint32_t mesh_count;
+    uint32_t texture_count;
+};
+
+struct MeshCacheTexture {
+    uint64_t offset; // of the pixels, rows tightly packed
+    int32_t width, height, components; // width 0 if the image could not be decoded
+    char type[20];
+    char path[100];
+};
+
+struct MeshCacheMesh {
+    uint64_t vertex_offset, index_offset;
+    uint32_t vertex_count, index_count;
+    uint32_t index_size; // 2 or 4 bytes
+    uint32_t texture_count;
+    uint32_t textures[MESH_CACHE_MAX_TEXTURES]; // into the texture table
+};
+
+// FNV-1a of the whole file, 0 if it cannot be read
+inline uint64_t hashFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if(!file) return 0;
+
+    uint64_t hash = 14695981039346656037ull;
+    char buffer[1 << 16];
+    while(file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+        for(std::streamsize i = 0; i < file.gcount(); i++) {
+            hash ^= (unsigned char)buffer[i];
+            hash *= 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+// collects the meshes and textures while a model is loaded through Assimp
+class MeshCacheWriter {
+private:
+    std::vector<MeshCacheMesh> meshes;
+    std::vector<MeshCacheTexture> textures;
+    std::vector<unsigned char> blob; // vertex, index and pixel data, offsets relative to its start
+    bool valid = true;
+
+    uint64_t append(const void* data, size_t bytes) {
+        blob.resize((blob.size() + MESH_CACHE_ALIGNMENT - 1) & ~size_t(MESH_CACHE_ALIGNMENT - 1));
+        uint64_t offset = blob.size();
+        blob.insert(blob.end(), (const unsigned char*)data, (const unsigned char*)data + bytes);
+        return offset;
+    }
+
+    static bool copyName(char* dest, size_t size, const std::string& name) {
+        if(name.size() >= size) return false;
+        std::memset(dest, 0, size);
+        std::memcpy(dest, name.data(), name.size());
+        return true;
+    }
+
+public:
+    // the index of the texture follows the order of the calls
+    void addTexture(const std::string& type, const std::string& path, const unsigned char* pixels, int width, int height, int components) {
+        MeshCacheTexture texture = {};
+        valid &= copyName(texture.type, sizeof(texture.type), type) && copyName(texture.path, sizeof(texture.path), path);
+        if(pixels != nullptr) {
+            texture.width = width;
+            texture.height = height;
+            texture.components = components;
+            texture.offset = append(pixels, size_t(width) * height * components);
+        }
+        textures.push_back(texture);
+    }
+
+    void addMesh(const std::vector<Vertex>& vertices, const std::vector<unsigned int>& indices, const std::vector<unsigned int>& texture_indices) {
+        if(texture_indices.size() > MESH_CACHE_MAX_TEXTURES) {
+            valid = false;
+            return;
+        }
+
+        MeshCacheMesh mesh = {};
+        mesh.vertex_count = (uint32_t)vertices.size();
+        mesh.index_count = (uint32_t)indices.size();
+        mesh.vertex_offset = append(vertices.data(), vertices.size() * sizeof(Vertex));
+
+        // 16 bit indices halve the index buffer of the small meshes
+        if(vertices.size() <= 0xFFFF) {
+            std::vector<uint16_t> short_indices(indices.begin(), indices.end());
+            mesh.index_size = 2;
+            mesh.index_offset = append(short_indices.data(), short_indices.size() * sizeof(uint16_t));
+        } else {
+            mesh.index_size = 4;
+            mesh.index_offset = append(indices.data(), indices.size() * sizeof(unsigned int));
+        }
+
+        mesh.texture_count = (uint32_t)texture_indices.size();
+        for(size_t i = 0; i < texture_indices.size(); i++) mesh.textures[i] = texture_indices[i];
+        meshes.push_back(mesh);
+    }
+
+    bool write(const std::string& path, uint64_t source_hash) const {
+        if(!valid) {
+            std::cerr << "ERROR: MESH CACHE: THE MODEL DOES NOT FIT THE CACHE FORMAT, NOT WRITING " << path << std::endl;
+            return false;
+        }
+
+        MeshCacheHeader header = {};
+        std::memcpy(header.magic, "CLMC", 4);
+        header.version = MESH_CACHE_VERSION;
+        header.source_hash = source_hash;
+        header.mesh_count = (uint32_t)meshes.size();
+        header.texture_count = (uint32_t)textures.size();
+
+        // the blob starts at an aligned offset after the tables
+        size_t tables = sizeof(header) + meshes.size() * sizeof(MeshCacheMesh) + textures.size() * sizeof(MeshCacheTexture);
+        size_t blob_start = (tables + MESH_CACHE_ALIGNMENT - 1) & ~size_t(MESH_CACHE_ALIGNMENT - 1);
+
+        std::vector<MeshCacheMesh> file_meshes = meshes;
+        for(MeshCacheMesh& mesh : file_meshes) {
+            mesh.vertex_offset += blob_start;
+            mesh.index_offset += blob_start;
+        }
+        std::vector<MeshCacheTexture> file_textures = textures;
+        for(MeshCacheTexture& texture : file_textures) if(texture.width != 0) texture.offset += blob_start;
+
+        // written to a temporary file first so that a crash never leaves a broken cache
+        std::string temp_path = path + ".tmp";
+        std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+        if(!file) {
+            std::cerr << "ERROR: MESH CACHE: CANNOT WRITE " << path << std::endl;
+            return false;
+        }
+        file.write((const char*)&header, sizeof(header));
+        file.write((const char*)file_meshes.data(), file_meshes.size() * sizeof(MeshCacheMesh));
+        file.write((const char*)file_textures.data(), file_textures.size() * sizeof(MeshCacheTexture));
+        std::vector<char> padding(blob_start - tables, 0);
+        file.write(padding.data(), padding.size());
+        file.write((const char*)blob.data(), blob.size());
+        file.close();
+
+        if(!file || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+            std::cerr << "ERROR: MESH CACHE: CANNOT WRITE " << path << std::endl;
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+// read-only view of a cache file, mapped into memory where possible
+class MeshCacheFile {
+private:
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+#if defined(_WIN32)
+    std::vector<unsigned char> contents;
+#endif
+
+    bool inside(uint64_t offset, uint64_t bytes) const {
+        return offset <= size && bytes <= size - offset;
+    }
+
+public:
+    MeshCacheFile(const std::string& path) {
+#if defined(_WIN32)
+        std::ifstream file(path, std::ios::binary);
+        if(!file) return;
+        contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data = contents.data();
+        size = contents.size();
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) return;
+        struct stat info;
+        if(fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(mapped != MAP_FAILED) {
+                data = (const unsigned char*)mapped;
+                size = info.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~MeshCacheFile() {
+#if !defined(_WIN32)
+        if(data != nullptr) munmap((void*)data, size);
+#endif
+    }
+
+    MeshCacheFile(const MeshCacheFile&) = delete;
+    MeshCacheFile& operator=(const MeshCacheFile&) = delete;
+
+    const MeshCacheHeader& header() const { return *(const MeshCacheHeader*)data; }
+    const MeshCacheMesh& mesh(uint32_t i) const { return ((const MeshCacheMesh*)(data + sizeof(MeshCacheHeader)))[i]; }
+    const MeshCacheTexture& texture(uint32_t i) const { return ((const MeshCacheTexture*)(data + sizeof(MeshCacheHeader) + header().mesh_count * sizeof(MeshCacheMesh)))[i]; }
+    const unsigned char* at(uint64_t offset) const { return data + offset; }
+
+    // checks the hash and that every table entry points inside the file
+    bool valid(uint64_t source_hash) const {
+        if(data == nullptr || size < sizeof(MeshCacheHeader)) return false;
+        const MeshCacheHeader& h = header();
+        if(std::memcmp(h.magic, "CLMC", 4) != 0 || h.version != MESH_CACHE_VERSION || h.source_hash != source_hash) return false;
+        if(!inside(sizeof(MeshCacheHeader), uint64_t(h.mesh_count) * sizeof(MeshCacheMesh) + uint64_t(h.texture_count) * sizeof(MeshCacheTexture))) return false;
+
+        for(uint32_t i = 0; i < h.mesh_count; i++) {
+            const MeshCacheMesh& m = mesh(i);
+            if(m.index_size != 2 && m.index_size != 4) return false;
+            if(m.texture_count > MESH_CACHE_MAX_TEXTURES) return false;
+            if(!inside(m.vertex_offset, uint64_t(m.vertex_count) * sizeof(Vertex)) || !inside(m.index_offset, uint64_t(m.index_count) * m.index_size)) return false;
+            for(uint32_t j = 0; j < m.texture_count; j++) if(m.textures[j] >= h.texture_count) return false;
+        }
+        for(uint32_t i = 0; i < h.texture_count; i++) {
+            const MeshCacheTexture& t = texture(i);
+            if(t.width != 0 && !inside(t.offset, uint64_t(t.width) * t.height * t.components)) return false;
+            if(t.type[sizeof(t.type)-1] != '\0' || t.path[sizeof(t.path)-1] != '\0') return false;
+        }
+        return true;
+    }
+};
+
+#endif /* mesh_cache_h */
@@ -18,16 +18,47 @@
 #include <assimp/postprocess.h>
 
 #include "mesh.h"
+#include "mesh_cache.h"
 #include "shader.h"
+#include "staging_buffer.h"
+#include "thread_pool.h"
 
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <map>
+#include <unordered_map>
 #include <vector>
+#include <memory>
+#include <chrono>
+#include <cmath>
 
-unsigned int TextureFromFile(const char* path, const std::string &directory);
+// CPU side of a mesh, prepared by a worker thread
+struct MeshData {
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;
+    std::vector<unsigned int> textures; // into the texture list of the model
+};
+
+// decoded image, prepared by a worker thread
+struct TextureData {
+    std::string type, path;
+    int width = 0, height = 0, components = 0;
+    unsigned char* pixels = nullptr; // stb_image buffer, null if the image could not be decoded
+};
+
+// result of the parsing task - the meshes and textures are still being processed by the other tasks
+struct ModelData {
+    bool valid = false;
+    uint64_t hash = 0;
+    std::unique_ptr<MeshCacheFile> cache; // set if the model is loaded from the cache
+    std::shared_ptr<Assimp::Importer> importer; // owns the scene read by the mesh tasks
+    std::vector<std::future<MeshData>> meshes;
+    std::vector<std::future<TextureData>> textures;
+};
+
+unsigned int TextureFromPixels(const unsigned char* data, int width, int height, int nrComponents, StagingBuffer* staging = nullptr);
 
 class Model {
 public:
@@ -35,43 +66,193 @@ public:
     std::vector<Mesh> meshes;
     std::string directory;
     
-    Model(std::string const &path) {
-        loadModel(path);
+    // bounding sphere of the model space vertices, known once the model is uploaded
+    glm::vec3 bounds_center = glm::vec3(0.0f);
+    float bounds_radius = 0.0f;
+    
+    // the model is parsed and its images decoded on the pool, or before the constructor returns if there is no pool
+    // the vertex and index arrays are freed after the upload unless keep_data is set
+    Model(std::string const &path, bool keep_data = false, ThreadPool* pool = nullptr) : path(path), keep_data(keep_data), pool(pool) {
+        start = std::chrono::high_resolution_clock::now();
+        directory = path.substr(0, path.find_last_of('/'));
+        
+        std::string model_path = path, model_directory = directory;
+        loading = runTask(pool, [model_path, model_directory, pool] {
+            return parse(model_path, model_directory, pool);
+        });
+        
+        if(pool == nullptr) upload(true);
+    }
+    
+    bool loaded() const {
+        return uploaded;
     }
     
-    void draw(Shader shader) {
+    // has to be called on the GL thread - uploads the model once the workers have finished (or waits for them)
+    bool upload(bool wait = false) {
+        if(uploaded) return true;
+        
+        if(!parsed) {
+            if(!futureReady(loading, wait)) return false;
+            data = loading.get();
+            parsed = true;
+        }
+        if(!data.valid) return false;
+        
+        for(auto& mesh : data.meshes) if(!futureReady(mesh, wait)) return false;
+        for(auto& texture : data.textures) if(!futureReady(texture, wait)) return false;
+        
+        StagingBuffer staging;
+        bounds_min = glm::vec3(INFINITY);
+        bounds_max = glm::vec3(-INFINITY);
+        if(data.cache) uploadCache(staging);
+        else uploadData(staging);
+        
+        bounds_center = 0.5f * (bounds_min + bounds_max);
+        bounds_radius = meshes.empty() ? 0.0f : 0.5f * glm::length(bounds_max - bounds_min);
+        data = ModelData();
+        uploaded = true;
+        
+        size_t resident = 0, buffers = 0;
+        for(const Mesh& mesh : meshes) {
+            resident += mesh.residentBytes();
+            buffers += mesh.bufferBytes();
+        }
+        double time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        std::cout << "SUCCESS: MODEL: LOADED " << path << " in " << time << " ms, meshes: " << meshes.size() << ", GPU buffers KB: " << (buffers >> 10) << ", CPU arrays KB: " << (resident >> 10) << std::endl;
+        return true;
+    }
+    
+    // nothing is drawn until the model is uploaded
+    void draw(Shader& shader) {
+        if(!upload()) return;
+        
         for(unsigned int i = 0; i < meshes.size(); i++) {
             meshes[i].draw(shader);
         }
     }
     
-private:
-    void loadModel(std::string const &path) {
-        Assimp::Importer importer;
-        const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
+    // one draw call per mesh, the instance buffer is attached to the meshes on the first call
+    void drawInstanced(Shader& shader, unsigned int instance_VBO, int instance_count) {
+        if(!upload() || instance_count == 0) return;
         
-        if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) {
-            std::cout << "ERROR::ASSIMP: " << importer.GetErrorString() << std::endl;
-            return;
+        if(attached_instance_VBO != instance_VBO) {
+            for(Mesh& mesh : meshes) mesh.setInstanceBuffer(instance_VBO);
+            attached_instance_VBO = instance_VBO;
+        }
+        
+        for(unsigned int i = 0; i < meshes.size(); i++) {
+            meshes[i].drawInstanced(shader, instance_count);
         }
-        directory = path.substr(0, path.find_last_of('/'));
-        processNode(scene->mRootNode, scene);
     }
+
+private:
+    std::string path;
+    bool keep_data;
+    ThreadPool* pool;
+    
+    std::chrono::high_resolution_clock::time_point start;
+    std::future<ModelData> loading;
+    ModelData data;
+    bool parsed = false, uploaded = false;
     
-    void processNode(aiNode* node, const aiScene* scene) {
-        for(unsigned int i = 0; i < node->mNumMeshes; i++) {
-            aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-            meshes.push_back(processMesh(mesh, scene));
+    glm::vec3 bounds_min, bounds_max;
+    unsigned int attached_instance_VBO = 0;
+    
+    void extendBounds(const Vertex* vertices, size_t count) {
+        for(size_t i = 0; i < count; i++) {
+            bounds_min = glm::min(bounds_min, vertices[i].Position);
+            bounds_max = glm::max(bounds_max, vertices[i].Position);
         }
-        for(unsigned int i = 0; i < node->mNumChildren; i++) {
-            processNode(node->mChildren[i], scene);
+    }
+    
+    // runs on a worker - the cache is used while it was baked from the same OBJ, otherwise the model is read by Assimp
+    static ModelData parse(const std::string& path, const std::string& directory, ThreadPool* pool) {
+        ModelData data;
+        data.hash = hashFile(path);
+        
+        if(data.hash != 0) {
+            data.cache.reset(new MeshCacheFile(path + ".cache"));
+            if(data.cache->valid(data.hash)) {
+                data.valid = true;
+                return data;
+            }
+            data.cache.reset();
+        }
+        
+        data.importer = std::make_shared<Assimp::Importer>();
+        const aiScene* scene = data.importer->ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
+        
+        if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) {
+            std::cout << "ERROR::ASSIMP: " << data.importer->GetErrorString() << std::endl;
+            return data;
         }
+        
+        // we assume a convention for sampler names in the shaders. Each diffuse texture should be named
+        // as 'texture_diffuseN' where N is a sequential number ranging from 1 to MAX_SAMPLER_NUMBER.
+        // Same applies to other texture as the following list summarizes:
+        // diffuse: texture_diffuseN
+        // specular: texture_specularN
+        // normal: texture_normalN
+        const std::pair<aiTextureType, const char*> texture_types[] = {
+            {aiTextureType_DIFFUSE, "texture_diffuse"},
+            {aiTextureType_SPECULAR, "texture_specular"},
+            {aiTextureType_HEIGHT, "texture_normal"},
+            {aiTextureType_AMBIENT, "texture_height"}
+        };
+        
+        // every image is decoded once, in its own task
+        std::unordered_map<std::string, unsigned int> texture_indices;
+        std::vector<std::vector<unsigned int>> material_textures(scene->mNumMaterials);
+        for(unsigned int m = 0; m < scene->mNumMaterials; m++) {
+            aiMaterial* material = scene->mMaterials[m];
+            for(const auto& type : texture_types) {
+                for(unsigned int i = 0; i < material->GetTextureCount(type.first); i++) {
+                    aiString str;
+                    material->GetTexture(type.first, i, &str);
+                    std::string texture_path = str.C_Str();
+                    
+                    auto found = texture_indices.find(texture_path);
+                    if(found == texture_indices.end()) {
+                        found = texture_indices.emplace(texture_path, (unsigned int)data.textures.size()).first;
+                        std::string texture_type = type.second;
+                        data.textures.push_back(runTask(pool, [directory, texture_path, texture_type] {
+                            return decodeTexture(directory, texture_path, texture_type);
+                        }));
+                    }
+                    material_textures[m].push_back(found->second);
+                }
+            }
+        }
+        
+        std::vector<const aiNode*> nodes = {scene->mRootNode};
+        while(!nodes.empty()) {
+            const aiNode* node = nodes.back();
+            nodes.pop_back();
+            
+            for(unsigned int i = 0; i < node->mNumMeshes; i++) {
+                const aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
+                std::vector<unsigned int> textures = material_textures[mesh->mMaterialIndex];
+                std::shared_ptr<Assimp::Importer> importer = data.importer;
+                data.meshes.push_back(runTask(pool, [mesh, textures, importer] {
+                    return processMesh(mesh, textures);
+                }));
+            }
+            // keep the order of the recursive traversal
+            for(unsigned int i = node->mNumChildren; i > 0; i--) nodes.push_back(node->mChildren[i-1]);
+        }
+        
+        data.valid = true;
+        return data;
     }
     
-    Mesh processMesh(aiMesh* mesh, const aiScene* scene) {
-        std::vector<Vertex> vertices;
-        std::vector<unsigned int> indices;
-        std::vector<Texture> textures;
+    // runs on a worker
+    static MeshData processMesh(const aiMesh* mesh, const std::vector<unsigned int>& textures) {
+        MeshData data;
+        data.textures = textures;
+        
+        data.vertices.reserve(mesh->mNumVertices);
+        data.indices.reserve(mesh->mNumFaces * 3); // triangulated
         
         for(unsigned int i = 0; i < mesh->mNumVertices; i++) {
             Vertex vertex;
@@ -109,73 +290,107 @@ private:
             }
             
             
-            vertices.push_back(vertex);
+            data.vertices.push_back(vertex);
         }
         
         for(unsigned int i = 0; i < mesh->mNumFaces; i++) {
-            aiFace face = mesh->mFaces[i];
+            const aiFace& face = mesh->mFaces[i];
             
-            for(unsigned int j = 0; j < face.mNumIndices; j++) indices.push_back(face.mIndices[j]);
+            data.indices.insert(data.indices.end(), face.mIndices, face.mIndices + face.mNumIndices);
         }
         
-        aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
-        
-        // we assume a convention for sampler names in the shaders. Each diffuse texture should be named
-        // as 'texture_diffuseN' where N is a sequential number ranging from 1 to MAX_SAMPLER_NUMBER.
-        // Same applies to other texture as the following list summarizes:
-        // diffuse: texture_diffuseN
-        // specular: texture_specularN
-        // normal: texture_normalN
+        return data;
+    }
+    
+    // runs on a worker
+    static TextureData decodeTexture(const std::string& directory, const std::string& path, const std::string& type) {
+        TextureData data;
+        data.type = type;
+        data.path = path;
         
-        std::vector<Texture> diffuseMaps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
-        textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
-        std::vector<Texture> specularMaps = loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular");
-        textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
-        std::vector<Texture> normalMaps = loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal");
-        textures.insert(textures.end(), normalMaps.begin(), normalMaps.end());
-        std::vector<Texture> heightMaps = loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height");
-        textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
+        std::string filename = directory + '/' + path;
+        data.pixels = stbi_load(filename.c_str(), &data.width, &data.height, &data.components, 0);
+        if(!data.pixels) std::cout << "ERROR::STBI: Texture failed to load at path: " << path << std::endl;
         
-        return Mesh(vertices, indices, textures);
+        return data;
     }
     
-    std::vector<Texture> loadMaterialTextures(aiMaterial* mat, aiTextureType type, std::string typeName) {
-        std::vector<Texture> textures;
-        
-        for(unsigned int i = 0; i < mat->GetTextureCount(type); i++) {
-            aiString str;
-            mat->GetTexture(type, i, &str);
-            // check if texture was loaded before and if so, continue to next iteration: skip loading a new texture
-            bool skip = false;
-            for(unsigned int j = 0; j < textures_loaded.size(); j++) {
-                if(std::strcmp(textures_loaded[j].path.data(), str.C_Str()) == 0) {
-                    textures.push_back(textures_loaded[j]);
-                    skip = true;
-                    break;
-                }
-            }
-            if(!skip) {
-                Texture texture;
-                texture.ID = TextureFromFile(str.C_Str(), this->directory);
-                texture.type = typeName;
-                texture.path = str.C_Str();
-                textures.push_back(texture);
-                textures_loaded.push_back(texture);
+    // upload the meshes and textures straight from the mapped cache file
+    void uploadCache(StagingBuffer& staging) {
+        const MeshCacheFile& cache = *data.cache;
+        const MeshCacheHeader& header = cache.header();
+        
+        textures_loaded.reserve(header.texture_count);
+        for(uint32_t i = 0; i < header.texture_count; i++) {
+            const MeshCacheTexture& t = cache.texture(i);
+            Texture texture;
+            texture.ID = TextureFromPixels(t.width != 0 ? cache.at(t.offset) : nullptr, t.width, t.height, t.components, &staging);
+            texture.type = t.type;
+            texture.path = t.path;
+            textures_loaded.push_back(texture);
+        }
+        
+        meshes.reserve(header.mesh_count);
+        for(uint32_t i = 0; i < header.mesh_count; i++) {
+            const MeshCacheMesh& m = cache.mesh(i);
+            std::vector<Texture> textures;
+            textures.reserve(m.texture_count);
+            for(uint32_t j = 0; j < m.texture_count; j++) textures.push_back(textures_loaded[m.textures[j]]);
+            
+            const Vertex* vertices = (const Vertex*)cache.at(m.vertex_offset);
+            extendBounds(vertices, m.vertex_count);
+            if(keep_data) {
+                std::vector<unsigned int> indices(m.index_count);
+                for(uint32_t j = 0; j < m.index_count; j++) indices[j] = m.index_size == 2 ? ((const uint16_t*)cache.at(m.index_offset))[j] : ((const uint32_t*)cache.at(m.index_offset))[j];
+                meshes.emplace_back(std::vector<Vertex>(vertices, vertices + m.vertex_count), std::move(indices), std::move(textures), true, &staging);
+            } else {
+                meshes.emplace_back(vertices, m.vertex_count, cache.at(m.index_offset), m.index_count, m.index_size == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT, std::move(textures), &staging);
             }
         }
-        return textures;
+    }
+    
+    // upload the data prepared by the workers and bake the cache for the next start
+    void uploadData(StagingBuffer& staging) {
+        MeshCacheWriter cache;
+        
+        textures_loaded.reserve(data.textures.size());
+        for(auto& future : data.textures) {
+            TextureData t = future.get();
+            Texture texture;
+            texture.ID = TextureFromPixels(t.pixels, t.width, t.height, t.components, &staging);
+            texture.type = t.type;
+            texture.path = t.path;
+            textures_loaded.push_back(texture);
+            
+            cache.addTexture(t.type, t.path, t.pixels, t.width, t.height, t.components);
+            stbi_image_free(t.pixels);
+        }
+        
+        meshes.reserve(data.meshes.size());
+        for(auto& future : data.meshes) {
+            MeshData m = future.get();
+            std::vector<Texture> textures;
+            textures.reserve(m.textures.size());
+            for(unsigned int index : m.textures) textures.push_back(textures_loaded[index]);
+            
+            extendBounds(m.vertices.data(), m.vertices.size());
+            cache.addMesh(m.vertices, m.indices, m.textures);
+            meshes.emplace_back(std::move(m.vertices), std::move(m.indices), std::move(textures), keep_data, &staging);
+        }
+        
+        if(data.hash == 0) return;
+        std::string cache_path = path + ".cache";
+        uint64_t hash = data.hash;
+        if(pool != nullptr) pool->submit([cache, cache_path, hash] { cache.write(cache_path, hash); });
+        else cache.write(cache_path, hash);
     }
 };
 
-unsigned int TextureFromFile(const char* path, const std::string &directory) {
-    std::string filename = std::string(path);
-    filename = directory + '/' + filename;
-    
+// data can be null - the texture is then left empty
+unsigned int TextureFromPixels(const unsigned char* data, int width, int height, int nrComponents, StagingBuffer* staging) {
     unsigned int textureID;
     glGenTextures(1, &textureID);
     
-    int width, height, nrComponents;
-    unsigned char* data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
     if(data) {
         GLenum format;
         if(nrComponents == 1) format = GL_RED;
@@ -183,18 +398,19 @@ unsigned int TextureFromFile(const char* path, const std::string &directory) {
         else format = GL_RGBA;
         
         glBindTexture(GL_TEXTURE_2D, textureID);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+        if(staging != nullptr) {
+            staging->texImage2D(format, width, height, format, data, size_t(width) * height * nrComponents);
+        } else {
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // the rows are tightly packed
+            glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        }
         glGenerateMipmap(GL_TEXTURE_2D);
         
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        
-        stbi_image_free(data);
-    } else {
-        std::cout << "ERROR::STBI: Texture failed to load at path: " << path << std::endl;
-        stbi_image_free(data);
     }
     
     return textureID;
@@ -31,6 +31,10 @@ private:
     
     float offset_y, offset_ang;
     
+    GLint model_loc;
+    GLint shadow_loc;
+    GLint radiance_loc, irradiance_loc;
+    
     void updateMMatrix(Camera& camera) {
         modelMatrix = glm::mat4(1.0f);
         modelMatrix = glm::translate(modelMatrix, pos + glm::vec3(0.0f, offset_y, 0.0f) - camera.transferPos()); // translate it down so it's at the center of the scene
@@ -40,19 +44,26 @@ private:
     }
     
 public:
-    Object(const char* model_path, const char* obj_vertex_path, const char* obj_fragment_path) : model(model_path), shader(obj_vertex_path, obj_fragment_path) {
+    // with a pool the model is loaded in the background and drawn once it is ready
+    Object(const char* model_path, const char* obj_vertex_path, const char* obj_fragment_path, ThreadPool* pool = nullptr) : model(model_path, false, pool), shader(obj_vertex_path, obj_fragment_path) {
         pos = glm::vec3(0.5f, 0.2f, 0.5f);
+        offset_y = offset_ang = 0.0f;
         scale = glm::vec3(0.2f);
+        model_loc = shader.location("M");
+        shadow_loc = shader.location("cloud_shadow");
+        radiance_loc = shader.location("sky_radiance");
+        irradiance_loc = shader.location("sky_irradiance");
     }
     
+    // the camera and the light are taken from the FrameData block
     void render(Camera& camera) {
         updateMMatrix(camera);
-        glm::mat4 PVMMatrix = camera.transferPVMatrix() * modelMatrix;
         
         shader.use();
-        shader.setMat4("M", modelMatrix);
-        shader.setMat4("PVM", PVMMatrix);
-        shader.setVec3("camera_pos", camera.transferPos());
+        shader.setMat4(model_loc, modelMatrix);
+        shader.setInt(shadow_loc, CLOUD_SHADOW_UNIT);
+        shader.setInt(radiance_loc, SKY_RADIANCE_UNIT);
+        shader.setInt(irradiance_loc, SKY_IRRADIANCE_UNIT);
         
         model.draw(shader);
     }
@@ -10,37 +10,93 @@
 
 #include <string>
 #include <fstream>
+#include <vector>
+#include <cmath>
+#include <chrono>
 
 #include "object.h"
+#include "instanced_object.h"
 #include "camera.h"
 
+// the same values are defined in screen.fs
+enum Upscaler {
+    UPSCALE_NEAREST,
+    UPSCALE_BILINEAR,
+    UPSCALE_BICUBIC,
+    UPSCALE_CAS,
+    UPSCALE_COUNT
+};
+
+#define RESIZE_DELAY 0.25f // seconds without a new size before the render targets are reallocated
+
 class Screen {
 private:
-    short width, height;
+    int width, height; // of the render targets, independent of the window
+    float render_scale;
+    int pixel_budget; // upper limit of width * height, 0 if there is none
+    
+    bool resize_pending = false;
+    int pending_width, pending_height;
+    std::chrono::steady_clock::time_point resize_request_time;
     Shader screen_shader;
     unsigned int FBO_scene, FBO_screen;
     
-    unsigned int scene_texture;
-    GLuint scene_texture_loc;
+    unsigned int scene_texture, scene_depth;
+    GLuint scene_texture_loc, scene_depth_loc;
     unsigned int screen_texture;
     GLuint screen_texture_loc;
     
+    Upscaler upscaler = UPSCALE_CAS;
+    float sharpness = 0.5f;
+    GLint upscaler_loc, sharpness_loc;
+    
     float vertices[12];
     unsigned int indices[6];
     unsigned int VBO, VAO, EBO;
     
+    // the internal size follows the output size through the render scale, limited by the pixel budget
+    void internalSize(int output_width, int output_height, int& buff_width, int& buff_height) const {
+        float scale = render_scale;
+        float pixels = float(output_width) * output_height * scale * scale;
+        if(pixel_budget > 0 && pixels > pixel_budget) scale *= std::sqrt(pixel_budget / pixels);
+        
+        buff_width = std::max(1, int(output_width * scale));
+        buff_height = std::max(1, int(output_height * scale));
+    }
+    
+    // (re)specify the storage of all the render targets at the current size
+    void allocateTargets() {
+        // the lit objects go over 1.0, so the colour stays floating point but packed in 32 bits
+        glBindTexture(GL_TEXTURE_2D, scene_texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R11F_G11F_B10F, width, height, 0, GL_RGB, GL_FLOAT, NULL);
+        
+        glBindTexture(GL_TEXTURE_2D, scene_depth);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+        
+        glBindTexture(GL_TEXTURE_2D, screen_texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    
     void setupSceneFramebuffer(Shader& cloud_shader) {
         glGenFramebuffers(1, &FBO_scene);
         glBindFramebuffer(GL_FRAMEBUFFER, FBO_scene);
         
-        glGenTextures(1, &scene_texture);
         glBindTexture(GL_TEXTURE_2D, scene_texture);
-        scene_texture_loc = glGetUniformLocation(cloud_shader.ID, "sceneTexture");
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, scene_texture, 0);
         
+        // the cloud shader linearizes the depth to stop the rays at the objects
+        glBindTexture(GL_TEXTURE_2D, scene_depth);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, scene_depth, 0);
+        
+        locateUniforms(cloud_shader);
+        
         if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) std::cout << "ERROR: OpenGL: Failed to create framebuffer" << std::endl;
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
     }
@@ -49,18 +105,25 @@ private:
         glGenFramebuffers(1, &FBO_screen);
         glBindFramebuffer(GL_FRAMEBUFFER, FBO_screen);
         
-        glGenTextures(1, &screen_texture);
         glBindTexture(GL_TEXTURE_2D, screen_texture);
-        screen_texture_loc = glGetUniformLocation(screen_shader.ID, "screenTexture");
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        locateScreenUniforms();
+        // the upscalers are built from bilinear taps
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, screen_texture, 0);
         
         if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) std::cout << "ERROR: OpenGL: Failed to create framebuffer" << std::endl;
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
     }
     
+    void locateScreenUniforms() {
+        screen_texture_loc = screen_shader.location("screenTexture");
+        upscaler_loc = screen_shader.location("upscaler");
+        sharpness_loc = screen_shader.location("sharpness");
+    }
+    
     inline void bindScene() {
         glBindFramebuffer(GL_FRAMEBUFFER, FBO_scene);
         glViewport(0, 0, width, height);
@@ -77,7 +140,8 @@ private:
     }
     
 public:
-    Screen(const char* screen_vertex_path, const char* screen_fragment_path, Shader& cloud_shader, int buff_width, int buff_height) : vertices {
+    // the render targets are render_scale times the output size, but at most pixel_budget pixels (0 - no limit)
+    Screen(const char* screen_vertex_path, const char* screen_fragment_path, Shader& cloud_shader, int output_width, int output_height, float render_scale = 1.0f, int pixel_budget = 0) : vertices {
         1.0f,  1.0f, 0.0f,  // top right
         1.0f, -1.0f, 0.0f,  // bottom right
         -1.0f, -1.0f, 0.0f,  // bottom left
@@ -85,7 +149,10 @@ public:
     }, indices {  // note that we start from 0!
         0, 1, 3,  // first Triangle
         1, 2, 3   // second Triangle
-    }, screen_shader(screen_vertex_path, screen_fragment_path), width(buff_width), height(buff_height) {
+    }, screen_shader(screen_vertex_path, screen_fragment_path), render_scale(render_scale), pixel_budget(pixel_budget) {
+        internalSize(output_width, output_height, width, height);
+        
+
         glGenVertexArrays(1, &VAO);
         glGenBuffers(1, &VBO);
         glGenBuffers(1, &EBO);
@@ -106,6 +173,11 @@ public:
         
         screen_shader.use();
         
+        glGenTextures(1, &scene_texture);
+        glGenTextures(1, &scene_depth);
+        glGenTextures(1, &screen_texture);
+        allocateTargets();
+        
         setupSceneFramebuffer(cloud_shader);
         setupScreenFramebuffer();
     }
@@ -117,6 +189,22 @@ public:
         
         glDeleteFramebuffers(1, &FBO_scene);
         glDeleteFramebuffers(1, &FBO_screen);
+        glDeleteTextures(1, &scene_texture);
+        glDeleteTextures(1, &scene_depth);
+        glDeleteTextures(1, &screen_texture);
+    }
+    
+    // the cloud shader was relinked, so its uniform locations may have moved
+    void locateUniforms(Shader& cloud_shader) {
+        scene_texture_loc = cloud_shader.location("sceneTexture");
+        scene_depth_loc = cloud_shader.location("sceneDepth");
+    }
+    
+    // reload the screen shader if the path belongs to it
+    bool reloadShaders(const std::string& path) {
+        if(!screen_shader.usesFile(path) || !screen_shader.reload()) return false;
+        locateScreenUniforms();
+        return true;
     }
     
     inline void clearScene() {
@@ -129,10 +217,24 @@ public:
     inline void drawObject(Object& obj, Camera& camera) {
         
         glEnable(GL_CULL_FACE);
+        glEnable(GL_DEPTH_TEST);
         bindScene();
         
         obj.render(camera);
         
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_CULL_FACE);
+    }
+    
+    // all the instanced objects are drawn with one face culling state change
+    inline void drawObjects(const std::vector<InstancedObject*>& objects, Camera& camera) {
+        glEnable(GL_CULL_FACE);
+        glEnable(GL_DEPTH_TEST);
+        bindScene();
+        
+        for(InstancedObject* obj : objects) obj->render(camera);
+        
+        glDisable(GL_DEPTH_TEST);
         glDisable(GL_CULL_FACE);
     }
     
@@ -145,6 +247,10 @@ public:
         glBindTexture(GL_TEXTURE_2D, scene_texture); // !!!!!!!!!!!!!
         glUniform1i(scene_texture_loc, 1);
         
+        glActiveTexture(GL_TEXTURE4);
+        glBindTexture(GL_TEXTURE_2D, scene_depth);
+        glUniform1i(scene_depth_loc, 4);
+        
         glBindVertexArray(VAO);
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
     }
@@ -156,14 +262,36 @@ public:
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D, screen_texture);
         glUniform1i(screen_texture_loc, 0);
+        glUniform1i(upscaler_loc, upscaler);
+        glUniform1f(sharpness_loc, sharpness);
         
         glBindVertexArray(VAO);
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
     }
     
+    void setUpscaler(Upscaler new_upscaler, float new_sharpness = 0.5f) {
+        upscaler = new_upscaler;
+        sharpness = glm::clamp(new_sharpness, 0.0f, 1.0f);
+    }
+    
+    void cycleUpscaler() {
+        upscaler = Upscaler((upscaler + 1) % UPSCALE_COUNT);
+        const char* names[] = {"nearest", "bilinear", "bicubic", "contrast adaptive sharpening"};
+        std::cout << "Upscaler: " << names[upscaler] << std::endl;
+    }
+    
+    // size of the scene and cloud targets
+    int internalWidth() const {
+        return width;
+    }
+    
+    int internalHeight() const {
+        return height;
+    }
+    
     inline void takeScreenshot(int scr_width, int scr_height, const std::string& name = "screenshot", bool show_image = false) {
         std::cout << "Taking screenshot: " << name << ".tga" << std::endl;
-        short TGA_header[] = {0, 2, 0, 0, 0, 0, width, height, 24};
+        short TGA_header[] = {0, 2, 0, 0, 0, 0, short(width), short(height), 24};
         char* pixel_data = new char[3*width*height]; //there are 3 colors (RGB) for each pixel
         std::ofstream file("screenshots/" + name + ".tga", std::ios::out | std::ios::binary);
         if(!pixel_data || !file) {
@@ -187,10 +315,30 @@ public:
         }
     }
     
-    /*void resize(int buff_width, int buff_height) {
+    // called for every new window size - the targets are reallocated once the size stops changing
+    void requestResize(int output_width, int output_height) {
+        resize_pending = true;
+        pending_width = output_width;
+        pending_height = output_height;
+        resize_request_time = std::chrono::steady_clock::now();
+    }
+    
+    // called once per frame, returns true if the render targets were reallocated
+    bool applyPendingResize() {
+        if(!resize_pending) return false;
+        if(std::chrono::duration<float>(std::chrono::steady_clock::now() - resize_request_time).count() < RESIZE_DELAY) return false;
+        resize_pending = false;
+        
+        int buff_width, buff_height;
+        internalSize(pending_width, pending_height, buff_width, buff_height);
+        if(pending_width == 0 || pending_height == 0 || (buff_width == width && buff_height == height)) return false; // minimised or unchanged
+        
         width = buff_width;
         height = buff_height;
-    }*/
+        allocateTargets();
+        std::cout << "Render targets: " << width << "x" << height << std::endl;
+        return true;
+    }
 };
 
 #endif /* screen_h */
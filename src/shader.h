@@ -14,12 +14,133 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <unordered_map>
+
+// binding point of the FrameData uniform block (see frame_uniforms.h)
+#define FRAME_DATA_BINDING 0
+// texture unit the cloud shadow map is bound to for the object shaders (see Clouds::bindShadow)
+#define CLOUD_SHADOW_UNIT 8
+// texture units of the sky cubemaps for the object shaders (see SkyCapture::bind)
+#define SKY_RADIANCE_UNIT 9
+#define SKY_IRRADIANCE_UNIT 10
 
 class Shader {
 public:
     unsigned int ID;
     
-    Shader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr) {
+    // the defines are inserted after the #version line of the fragment shader
+    Shader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr, const std::string& defines = "") : vertexPath(vertexPath), fragmentPath(fragmentPath), geometryPath(geometryPath != nullptr ? geometryPath : ""), defines(defines) {
+        compile(ID);
+        cacheUniforms();
+    }
+    
+    // compile the program from its files again - the last good program is kept if the new one fails
+    bool reload() {
+        unsigned int program;
+        if(!compile(program)) {
+            if(program != 0) glDeleteProgram(program);
+            std::cout << "ERROR::SHADER::RELOAD_FAILED, KEEPING THE LAST GOOD PROGRAM: " << fragmentPath << std::endl;
+            return false;
+        }
+        glDeleteProgram(ID);
+        ID = program;
+        cacheUniforms();
+        std::cout << "SUCCESS::SHADER::RELOADED: " << fragmentPath << std::endl;
+        return true;
+    }
+    
+    bool usesFile(const std::string& path) const {
+        return path == vertexPath || path == fragmentPath || (!geometryPath.empty() && path == geometryPath);
+    }
+    
+    void use() {
+        glUseProgram(ID);
+    }
+    
+    // locations are cached when the program is linked, -1 for the uniforms which are not active
+    GLint location(const std::string &name) const {
+        auto it = uniforms.find(name);
+        return it != uniforms.end() ? it->second : -1;
+    }
+    
+    void setBool(const std::string &name, bool value) const {
+        glUniform1i(location(name), (int)value);
+    }
+    void setInt(const std::string &name, int value) const {
+        glUniform1i(location(name), value);
+    }
+    void setFloat(const std::string &name, float value) const {
+        glUniform1f(location(name), value);
+    }
+    void setVec2(const std::string &name, const glm::vec2 &value) const {
+        glUniform2fv(location(name), 1, &value[0]);
+    }
+    void setVec2(const std::string &name, float x, float y) const {
+        glUniform2f(location(name), x, y);
+    }
+    void setVec3(const std::string &name, const glm::vec3 &value) const {
+        glUniform3fv(location(name), 1, &value[0]);
+    }
+    void setVec3(const std::string &name, float x, float y, float z) const {
+        glUniform3f(location(name), x, y, z);
+    }
+    void setVec4(const std::string &name, const glm::vec4 &value) const {
+        glUniform4fv(location(name), 1, &value[0]);
+    }
+    void setVec4(const std::string &name, float x, float y, float z, float w) const {
+        glUniform4f(location(name), x, y, z, w);
+    }
+    void setMat2(const std::string &name, const glm::mat2 &mat) const {
+        glUniformMatrix2fv(location(name), 1, GL_FALSE, &mat[0][0]);
+    }
+    void setMat3(const std::string &name, const glm::mat3 &mat) const {
+        glUniformMatrix3fv(location(name), 1, GL_FALSE, &mat[0][0]);
+    }
+    void setMat4(const std::string &name, const glm::mat4 &mat) const {
+        glUniformMatrix4fv(location(name), 1, GL_FALSE, &mat[0][0]);
+    }
+    
+    // setters for the locations kept by the callers - used in the draw loop
+    void setInt(GLint loc, int value) const {
+        glUniform1i(loc, value);
+    }
+    void setFloat(GLint loc, float value) const {
+        glUniform1f(loc, value);
+    }
+    void setVec3(GLint loc, const glm::vec3 &value) const {
+        glUniform3fv(loc, 1, &value[0]);
+    }
+    void setMat4(GLint loc, const glm::mat4 &mat) const {
+        glUniformMatrix4fv(loc, 1, GL_FALSE, &mat[0][0]);
+    }
+    
+private:
+    std::string vertexPath, fragmentPath, geometryPath;
+    std::string defines;
+    std::unordered_map<std::string, GLint> uniforms;
+    
+    void cacheUniforms() {
+        uniforms.clear();
+        
+        GLint count = 0;
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+        for(GLint i = 0; i < count; i++) {
+            char name[256];
+            GLsizei length;
+            GLint size;
+            GLenum type;
+            glGetActiveUniform(ID, i, sizeof(name), &length, &size, &type, name);
+            
+            GLint loc = glGetUniformLocation(ID, name);
+            if(loc == -1) continue; // members of the uniform blocks have no location
+            
+            std::string uniform(name, length);
+            uniforms[uniform] = loc;
+            if(uniform.size() > 3 && uniform.compare(uniform.size()-3, 3, "[0]") == 0) uniforms[uniform.substr(0, uniform.size()-3)] = loc;
+        }
+    }
+    
+    bool compile(unsigned int& program) {
         std::string vertexCode;
         std::string fragmentCode;
         std::string geometryCode;
@@ -45,8 +166,12 @@ public:
             
             vertexCode = vShaderStream.str();
             fragmentCode = fShaderStream.str();
+            if(!defines.empty()) {
+                size_t line_end = fragmentCode.compare(0, 8, "#version") == 0 ? fragmentCode.find('\n') : std::string::npos;
+                fragmentCode.insert(line_end != std::string::npos ? line_end + 1 : 0, defines);
+            }
             
-            if(geometryPath != nullptr) {
+            if(!geometryPath.empty()) {
                 gShaderFile.open(geometryPath);
                 std::stringstream gShaderStream;
                 gShaderStream << gShaderFile.rdbuf();
@@ -55,87 +180,53 @@ public:
             }
         } catch(std::ifstream::failure e) {
             std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
+            program = 0;
+            return false;
         }
         
         const char* vShaderCode = vertexCode.c_str();
         const char* fShaderCode = fragmentCode.c_str();
         
         unsigned int vertex, fragment;
+        bool success = true;
         
         vertex = glCreateShader(GL_VERTEX_SHADER);
         glShaderSource(vertex, 1, &vShaderCode, NULL);
         glCompileShader(vertex);
-        checkCompileErrors(vertex, "VERTEX");
+        success &= checkCompileErrors(vertex, "VERTEX");
         
         fragment = glCreateShader(GL_FRAGMENT_SHADER);
         glShaderSource(fragment, 1, &fShaderCode, NULL);
         glCompileShader(fragment);
-        checkCompileErrors(fragment, "FRAGMENT");
+        success &= checkCompileErrors(fragment, "FRAGMENT");
         
         unsigned int geometry;
-        if(geometryPath != nullptr) {
+        if(!geometryPath.empty()) {
             const char* gShaderCode = geometryCode.c_str();
             geometry = glCreateShader(GL_GEOMETRY_SHADER);
             glShaderSource(geometry, 1, &gShaderCode, NULL);
             glCompileShader(geometry);
-            checkCompileErrors(geometry, "GEOMETRY");
+            success &= checkCompileErrors(geometry, "GEOMETRY");
         }
         
-        ID = glCreateProgram();
-        glAttachShader(ID, vertex);
-        glAttachShader(ID, fragment);
-        if(geometryPath != nullptr) glAttachShader(ID, geometry);
-        glLinkProgram(ID);
-        checkCompileErrors(ID, "PROGRAM");
+        program = glCreateProgram();
+        glAttachShader(program, vertex);
+        glAttachShader(program, fragment);
+        if(!geometryPath.empty()) glAttachShader(program, geometry);
+        glLinkProgram(program);
+        success &= checkCompileErrors(program, "PROGRAM");
+        
+        GLuint frame_block = glGetUniformBlockIndex(program, "FrameData");
+        if(frame_block != GL_INVALID_INDEX) glUniformBlockBinding(program, frame_block, FRAME_DATA_BINDING);
         
         glDeleteShader(vertex);
         glDeleteShader(fragment);
-        if(geometryPath != nullptr) glDeleteShader(geometry);
-    }
-    
-    void use() {
-        glUseProgram(ID);
-    }
-    
-    void setBool(const std::string &name, bool value) const {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
-    }
-    void setInt(const std::string &name, int value) const {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
-    }
-    void setFloat(const std::string &name, float value) const {
-        glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
-    }
-    void setVec2(const std::string &name, const glm::vec2 &value) const {
-        glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
-    }
-    void setVec2(const std::string &name, float x, float y) const {
-        glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
-    }
-    void setVec3(const std::string &name, const glm::vec3 &value) const {
-        glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
-    }
-    void setVec3(const std::string &name, float x, float y, float z) const {
-        glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
-    }
-    void setVec4(const std::string &name, const glm::vec4 &value) const {
-        glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
-    }
-    void setVec4(const std::string &name, float x, float y, float z, float w) const {
-        glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
-    }
-    void setMat2(const std::string &name, const glm::mat2 &mat) const {
-        glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
-    }
-    void setMat3(const std::string &name, const glm::mat3 &mat) const {
-        glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
-    }
-    void setMat4(const std::string &name, const glm::mat4 &mat) const {
-        glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        if(!geometryPath.empty()) glDeleteShader(geometry);
+        
+        return success;
     }
     
-private:
-    void checkCompileErrors(unsigned int shader, std::string type) {
+    bool checkCompileErrors(unsigned int shader, std::string type) {
         int success;
         char infoLog[1024];
         
@@ -143,15 +234,16 @@ private:
             glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
             if(!success) {
                 glGetShaderInfoLog(shader, 1024, NULL, infoLog);
-                std::cout << "ERROR::SHADER_COMPILATION_ERROR of type: " << "\n" << infoLog << "\n" << "--------------------------------------------" << std::endl;
+                std::cout << "ERROR::SHADER_COMPILATION_ERROR of type: " << type << "\n" << infoLog << "\n" << "--------------------------------------------" << std::endl;
             }
         } else {
             glGetProgramiv(shader, GL_LINK_STATUS, &success);
             if(!success) {
-                glGetShaderInfoLog(shader, 1024, NULL, infoLog);
+                glGetProgramInfoLog(shader, 1024, NULL, infoLog);
                 std::cout << "ERROR::PROGRAM_LINKING_ERROR:\n" << infoLog << "\n" << "--------------------------------------------" << std::endl;
             }
         }
+        return success;
     }
     
 };
@@ -1,37 +1,48 @@
 #version 410 core
 
-#define SAMPLE_SEP 0.003f
-#define SAMPLE_SEP_BLANK 0.01f
+// SAMPLE_SEP, SAMPLE_SEP_BLANK, SIZE, MAIN_RAY_ABSORBTION, BRIGHTNESS_AMPLIFY, MULTI_SCATTER_STRENGTH, COVERAGE_LOW,
+// DETAIL_BAND, DETAIL_STRENGTH and the colours are defined in front of this code from cloud_constants.h
 
-#define SIZE 1.0f
-#define MAIN_RAY_ABSORBTION 200.0f
-#define BRIGHTNESS_AMPLIFY 190.0f
+#define BRICK_SIZE 8 // see brick_volume.h
+#define BRICK_APRON_SIZE 10
 
 in vec2 fragPos;
 out vec4 fragColor;
 
-uniform sampler3D sam;
+uniform sampler3D density_sampler; // atlas of the occupied bricks
+uniform usampler3D brick_index; // atlas position of every brick, alpha is 0 for the empty ones
+uniform sampler2D coverage_sampler; // R - coverage, G - cloud type, over the xz plane of the box
+uniform sampler3D detail_sampler; // tileable high frequency noise
+uniform sampler3D light_sampler_a; // light volumes baked for the two directions around light_dir, coarser than the density and filtered trilinearly
+uniform sampler3D light_sampler_b;
+uniform float light_blend;
 uniform sampler2D sceneTexture;
-uniform float time;
-
-uniform vec3 origin;
-uniform vec3 camera_llc; // camera's lower left corner position
-uniform vec3 horizontal;
-uniform vec3 vertical;
+uniform sampler2D sceneDepth;
+
+layout(std140) uniform FrameData { // updated once per frame, see frame_uniforms.h
+    mat4 PV;
+    vec3 origin;
+    float time;
+    vec3 camera_llc; // camera's lower left corner position
+    vec3 horizontal;
+    vec3 vertical;
+    vec3 light_dir;
+    float near_plane;
+    float far_plane;
+    float detail_scale; // repetitions of the detail volume over the box
+    vec3 cloud_velocity; // the clouds drift with the time
+};
 
 const vec3 box_origin = vec3(0.0f, 0.0f, 0.0f);
 const vec3 box_end = vec3(SIZE, SIZE, SIZE);
 const float SIZE_INV = 1.0f / SIZE;
 
-const vec3 light_dir = normalize(vec3(0.5f, 1.0f, -0.3f));
-const vec3 light_col = vec3(144.0f/255.0f, 154.0f/255.0f, 171.0f/255.0f);
-const vec3 no_light_col = vec3(71.0f/255.0f, 73.0f/255.0f, 77.0f/255.0f); //vec3(0.514f, 0.392f, 0.494f);//vec3(0.933f, 0.663f, 0.604f);
+const vec3 light_col = LIGHT_COL;
+const vec3 no_light_col = NO_LIGHT_COL;
 
-const vec3 bottom_col = vec3(34.0f/255.0f, 41.0f/255.0f, 46.0f/255.0f);
-const vec3 top_col = vec3(60.0f/255.0f, 69.0f/255.0f, 77.0f/255.0f);
-const vec3 moon_col = vec3(203.0f/255.0f, 214.0f/255.0f, 234.0f/255.0f) * 1.5f;
-
-const vec3 velocity = vec3(0.05f, 0.0f, 0.02f);
+const vec3 bottom_col = BOTTOM_COL;
+const vec3 top_col = TOP_COL;
+const vec3 moon_col = MOON_COL;
 
 
 struct Ray {
@@ -71,10 +82,49 @@ float distInBox(inout Ray r) {
     return dist_inside_box;
 }
 
+// the density texture repeats - find the brick of the wrapped point and filter inside its copy in the atlas
+// the coverage map has a higher resolution than the volume, so it also sharpens the edges of the covered areas
+float densityAt(in vec3 sample_point) {
+    if(texture(coverage_sampler, sample_point.xz).r <= COVERAGE_LOW) return 0.0f;
+    
+    ivec3 bricks = textureSize(brick_index, 0);
+    vec3 voxel = fract(sample_point) * vec3(bricks * BRICK_SIZE);
+    ivec3 brick = min(ivec3(voxel) / BRICK_SIZE, bricks - 1);
+    
+    uvec4 entry = texelFetch(brick_index, brick, 0);
+    if(entry.a == 0u) return 0.0f;
+    
+    vec3 atlas_voxel = vec3(entry.xyz) * float(BRICK_APRON_SIZE) + 1.0f + (voxel - vec3(brick * BRICK_SIZE));
+    return texture(density_sampler, atlas_voxel / vec3(textureSize(density_sampler, 0))).r;
+}
+
+// the detail is sampled only near the edges of the clouds, where the base density is in the band
+float erodeDensity(float base, in vec3 sample_point) {
+    if(base <= 0.0f || base >= DETAIL_BAND) return base;
+    
+    float detail = texture(detail_sampler, sample_point * detail_scale).r;
+    float edge = 1.0f - base / DETAIL_BAND; // 1 at the outside of the band, 0 at its inside
+    return max(0.0f, base - (1.0f - detail) * edge * DETAIL_BAND * DETAIL_STRENGTH);
+}
+
 float sampleDensity(float density, float sub_dist) {
     return density * sub_dist * SIZE_INV;
 }
 
+// single scattering transmittance plus the baked multiple scattering octaves
+float sampleLight(in vec3 sample_point) {
+    vec2 light = mix(texture(light_sampler_a, sample_point).rg, texture(light_sampler_b, sample_point).rg, light_blend);
+    return light.x + light.y * MULTI_SCATTER_STRENGTH;
+}
+
+// distance along the ray to the point stored in the depth buffer
+float depthToDistance(float depth, in vec3 dir) {
+    float z_ndc = depth * 2.0f - 1.0f;
+    float z_view = 2.0f * near_plane * far_plane / (far_plane + near_plane - z_ndc * (far_plane - near_plane));
+    vec3 forward = camera_llc + 0.5f*horizontal + 0.5f*vertical;
+    return z_view / dot(dir, forward);
+}
+
 vec3 calculateBackground(in vec3 dir) {
     float angle = 0.5f+0.5f*dot(dir, -light_dir);
     
@@ -100,13 +150,14 @@ void main() {
     
     vec3 background_color;
     
-    vec4 obj_data = texture(sceneTexture, fragPos);
-    float obj_dist = obj_data.w;
-    if(obj_dist == 0.0f) {
+    float obj_depth = texture(sceneDepth, fragPos).r;
+    float obj_dist;
+    if(obj_depth == 1.0f) {
         obj_dist = 1.0f/0.0f;
         background_color = calculateBackground(r_main.dir);
     } else {
-        background_color = obj_data.rgb;
+        obj_dist = depthToDistance(obj_depth, r_main.dir);
+        background_color = texture(sceneTexture, fragPos).rgb;
     }
     
     if(dist_in_box > 0.0f) {
@@ -121,13 +172,12 @@ void main() {
         float r_param_max = r_main.param + dist_in_box;
         
         while(dist <= dist_in_box && r_main.param < obj_dist) {
-            vec3 sample_point = currentRayPoint(r_main) * SIZE_INV + velocity * time;
-            vec2 data = texture(sam, sample_point).rg;
-            float data_point = data.x;
+            vec3 sample_point = currentRayPoint(r_main) * SIZE_INV + cloud_velocity * time;
+            float data_point = erodeDensity(densityAt(sample_point), sample_point);
             
             if(data_point > 0.0f) {
                 float dens_step = sampleDensity(data_point, sub_dist);
-                float light_transmittance = data.y;
+                float light_transmittance = sampleLight(sample_point);
                 
                 brightness += dens_step * light_transmittance * transmittance;
                 transmittance *= exp(-dens_step * MAIN_RAY_ABSORBTION);
@@ -145,12 +195,11 @@ void main() {
         if(r_main.param < obj_dist) {
             r_main.param = r_param_max;
             
-            vec3 sample_point = currentRayPoint(r_main) * SIZE_INV + velocity * time;
-            vec2 data = texture(sam, sample_point).rg;
-            float data_point = data.x;
+            vec3 sample_point = currentRayPoint(r_main) * SIZE_INV + cloud_velocity * time;
+            float data_point = erodeDensity(densityAt(sample_point), sample_point);
             
             float dens_step = sampleDensity(data_point, sub_dist);
-            float light_transmittance = data.y;
+            float light_transmittance = sampleLight(sample_point);
             
             brightness += dens_step * light_transmittance * transmittance;
             transmittance *= exp(-dens_step * MAIN_RAY_ABSORBTION);
@@ -6,26 +6,59 @@ in vec2 tex_coords;
 in vec3 cam_rel_pos;
 
 uniform sampler2D obj_texture;
-uniform vec3 camera_pos;
+uniform sampler2D cloud_shadow; // transmittance of the clouds along light_dir from the bottom of the cloud box, see Clouds::updateShadow
+uniform samplerCube sky_radiance; // the clouds around the camera, the mip levels are blurred for the rougher reflections - see sky_capture.h
+uniform samplerCube sky_irradiance; // the ambient light from the clouds for every normal
+
+layout(std140) uniform FrameData { // updated once per frame, see frame_uniforms.h
+    mat4 PV;
+    vec3 origin;
+    float time;
+    vec3 camera_llc; // camera's lower left corner position
+    vec3 horizontal;
+    vec3 vertical;
+    vec3 light_dir;
+    float near_plane;
+    float far_plane;
+    float detail_scale; // repetitions of the detail volume over the box
+    vec3 cloud_velocity; // the clouds drift with the time
+};
 
 const vec3 light_col = vec3(144.0f/255.0f, 154.0f/255.0f, 171.0f/255.0f);
-const vec3 light_dir = normalize(vec3(0.5f, 1.0f, -0.3f));
 
 const float ambient_strength = 1.0f;
 const float specular_strength = 1.0f;
+const float reflectivity = 0.1f;
+const float roughness_lod = 3.0f; // mip level of sky_radiance the reflections are read from
+
+// follow the light ray of the fragment to the bottom of the cloud box, where the shadow map is baked - the map moves with the clouds
+float cloudShadow(in vec3 frag_pos) {
+    if(frag_pos.y >= 1.0f) return 1.0f;
+    
+    vec2 bottom = frag_pos.xz - light_dir.xz * (frag_pos.y / light_dir.y);
+    if(any(lessThan(bottom, vec2(0.0f))) || any(greaterThan(bottom, vec2(1.0f)))) return 1.0f;
+    
+    return texture(cloud_shadow, bottom + cloud_velocity.xz * time).r;
+}
 
 void main() {
-    vec3 frag_pos = cam_rel_pos + camera_pos;
+    vec3 frag_pos = cam_rel_pos + origin;
     vec3 n_normal = normalize(normal);
     
-    float diffuse_strength = max(dot(n_normal, light_dir), 0.0f);
+    float shadow = cloudShadow(frag_pos);
+    
+    float diffuse_strength = max(dot(n_normal, light_dir), 0.0f) * shadow;
     
     vec3 view_dir = normalize(cam_rel_pos);
     vec3 reflect_dir = reflect(light_dir, n_normal);
     
-    float specular_factor = pow(max(dot(view_dir, reflect_dir), 0.0f), 32);
+    float specular_factor = pow(max(dot(view_dir, reflect_dir), 0.0f), 32) * shadow;
+    
+    frag_color = vec4(texture(obj_texture, tex_coords).rgb, 1.0f); // the distance is read from the depth buffer
     
-    frag_color = vec4(texture(obj_texture, tex_coords).rgb, length(cam_rel_pos));
+    vec3 ambient = texture(sky_irradiance, n_normal).rgb * ambient_strength;
+    vec3 reflection = textureLod(sky_radiance, reflect(view_dir, n_normal), roughness_lod).rgb * reflectivity;
     
-    frag_color.xyz *= ((ambient_strength + diffuse_strength + specular_factor * specular_strength) * light_col);
+    frag_color.xyz *= ambient + (diffuse_strength + specular_factor * specular_strength) * light_col;
+    frag_color.xyz += reflection;
 }
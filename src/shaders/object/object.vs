@@ -7,8 +7,21 @@ out vec3 normal;
 out vec2 tex_coords;
 out vec3 cam_rel_pos;
 
-uniform mat4 M;
-uniform mat4 PVM;
+uniform mat4 M; // relative to the camera
+
+layout(std140) uniform FrameData { // updated once per frame, see frame_uniforms.h
+    mat4 PV;
+    vec3 origin;
+    float time;
+    vec3 camera_llc; // camera's lower left corner position
+    vec3 horizontal;
+    vec3 vertical;
+    vec3 light_dir;
+    float near_plane;
+    float far_plane;
+    float detail_scale; // repetitions of the detail volume over the box
+    vec3 cloud_velocity; // the clouds drift with the time
+};
 
 void main() {
     normal = mat3(transpose(inverse(M))) * a_normal; 
@@ -16,6 +29,7 @@ void main() {
     
     vec4 pos4 = vec4(a_pos, 1.0f);
     
-    cam_rel_pos = (M * pos4).xyz;
-    gl_Position = PVM * pos4;
+    vec4 cam_rel_pos4 = M * pos4;
+    cam_rel_pos = cam_rel_pos4.xyz;
+    gl_Position = PV * cam_rel_pos4;
 }
@@ -0,0 +1,32 @@
+#version 410 core
+layout (location = 0) in vec3 a_pos;
+layout (location = 1) in vec3 a_normal;
+layout (location = 2) in vec2 a_tex_coords;
+layout (location = 5) in mat4 a_model; // per instance, in the world space
+
+out vec3 normal;
+out vec2 tex_coords;
+out vec3 cam_rel_pos;
+
+layout(std140) uniform FrameData { // updated once per frame, see frame_uniforms.h
+    mat4 PV;
+    vec3 origin;
+    float time;
+    vec3 camera_llc; // camera's lower left corner position
+    vec3 horizontal;
+    vec3 vertical;
+    vec3 light_dir;
+    float near_plane;
+    float far_plane;
+    float detail_scale; // repetitions of the detail volume over the box
+    vec3 cloud_velocity; // the clouds drift with the time
+};
+
+void main() {
+    normal = mat3(a_model) * a_normal; // the instances are scaled uniformly, the fragment shader normalizes it
+    tex_coords = a_tex_coords;
+    
+    vec4 cam_rel_pos4 = a_model * vec4(a_pos, 1.0f) - vec4(origin, 0.0f);
+    cam_rel_pos = cam_rel_pos4.xyz;
+    gl_Position = PV * cam_rel_pos4;
+}
@@ -1,10 +1,78 @@
 #version 410 core
 
+// the upscalers of the low resolution cloud buffer, selected with Screen::setUpscaler
+#define UPSCALE_NEAREST 0
+#define UPSCALE_BILINEAR 1
+#define UPSCALE_BICUBIC 2
+#define UPSCALE_CAS 3
+
 out vec4 fragColor;
 in vec2 fragPos;
 
-uniform sampler2D screenTexture;
+uniform sampler2D screenTexture; // sampled with GL_LINEAR
+uniform int upscaler;
+uniform float sharpness; // 0 - 1, used by the CAS upscaler
+
+// Catmull-Rom with 9 bilinear taps instead of 16 point taps
+vec3 sampleBicubic(in vec2 uv) {
+    vec2 size = vec2(textureSize(screenTexture, 0));
+    vec2 sample_pos = uv * size;
+    vec2 center = floor(sample_pos - 0.5f) + 0.5f;
+    vec2 f = sample_pos - center;
+    
+    vec2 w0 = f * (-0.5f + f * (1.0f - 0.5f * f));
+    vec2 w1 = 1.0f + f * f * (-2.5f + 1.5f * f);
+    vec2 w2 = f * (0.5f + f * (2.0f - 1.5f * f));
+    vec2 w3 = f * f * (-0.5f + 0.5f * f);
+    
+    vec2 w12 = w1 + w2;
+    vec2 offset12 = w2 / w12;
+    
+    vec2 pos0 = (center - 1.0f) / size;
+    vec2 pos3 = (center + 2.0f) / size;
+    vec2 pos12 = (center + offset12) / size;
+    
+    vec3 result = vec3(0.0f);
+    result += texture(screenTexture, vec2(pos0.x, pos0.y)).rgb * w0.x * w0.y;
+    result += texture(screenTexture, vec2(pos12.x, pos0.y)).rgb * w12.x * w0.y;
+    result += texture(screenTexture, vec2(pos3.x, pos0.y)).rgb * w3.x * w0.y;
+    
+    result += texture(screenTexture, vec2(pos0.x, pos12.y)).rgb * w0.x * w12.y;
+    result += texture(screenTexture, vec2(pos12.x, pos12.y)).rgb * w12.x * w12.y;
+    result += texture(screenTexture, vec2(pos3.x, pos12.y)).rgb * w3.x * w12.y;
+    
+    result += texture(screenTexture, vec2(pos0.x, pos3.y)).rgb * w0.x * w3.y;
+    result += texture(screenTexture, vec2(pos12.x, pos3.y)).rgb * w12.x * w3.y;
+    result += texture(screenTexture, vec2(pos3.x, pos3.y)).rgb * w3.x * w3.y;
+    
+    return max(result, vec3(0.0f));
+}
+
+// contrast adaptive sharpening of the bilinear result - sharpens less where the neighbourhood already has a high contrast
+vec3 sampleCAS(in vec2 uv) {
+    vec2 texel = 1.0f / vec2(textureSize(screenTexture, 0));
+    
+    vec3 c = texture(screenTexture, uv).rgb;
+    vec3 n = texture(screenTexture, uv + vec2(0.0f, -texel.y)).rgb;
+    vec3 s = texture(screenTexture, uv + vec2(0.0f, texel.y)).rgb;
+    vec3 w = texture(screenTexture, uv + vec2(-texel.x, 0.0f)).rgb;
+    vec3 e = texture(screenTexture, uv + vec2(texel.x, 0.0f)).rgb;
+    
+    vec3 min_col = min(c, min(min(n, s), min(w, e)));
+    vec3 max_col = max(c, max(max(n, s), max(w, e)));
+    
+    vec3 amp = sqrt(clamp(min(min_col, 1.0f - max_col) / max(max_col, 1e-4f), 0.0f, 1.0f));
+    vec3 weight = -amp * mix(0.125f, 0.2f, sharpness);
+    
+    return clamp((c + weight * (n + s + w + e)) / (1.0f + 4.0f * weight), 0.0f, 1.0f);
+}
 
 void main() {
-    fragColor = vec4(texture(screenTexture, fragPos).rgb, 1.0f); //= vec4(fragPos, 1.0f, 1.0f);//
+    vec3 color;
+    if(upscaler == UPSCALE_NEAREST) color = texelFetch(screenTexture, ivec2(fragPos * vec2(textureSize(screenTexture, 0))), 0).rgb;
+    else if(upscaler == UPSCALE_BICUBIC) color = sampleBicubic(fragPos);
+    else if(upscaler == UPSCALE_CAS) color = sampleCAS(fragPos);
+    else color = texture(screenTexture, fragPos).rgb;
+    
+    fragColor = vec4(color, 1.0f);
 }
@@ -0,0 +1,39 @@
+#version 410 core
+
+#define PHI_STEPS 16
+#define THETA_STEPS 8
+#define PI 3.14159265f
+
+in vec2 fragPos;
+out vec4 fragColor;
+
+uniform samplerCube radiance; // captured sky, see sky_capture.h
+uniform float radiance_lod; // a blurred level, so the few samples do not alias
+uniform vec3 face_llc; // direction of the texel, like the camera vectors of FrameData
+uniform vec3 face_horizontal;
+uniform vec3 face_vertical;
+
+// the radiance averaged over the hemisphere around the normal, weighted by the cosine - the ambient light
+// of a diffuse surface facing that way
+void main() {
+    vec3 n = normalize(face_llc + fragPos.x*face_horizontal + fragPos.y*face_vertical);
+    vec3 up = abs(n.y) < 0.999f ? vec3(0.0f, 1.0f, 0.0f) : vec3(1.0f, 0.0f, 0.0f);
+    vec3 tangent = normalize(cross(up, n));
+    vec3 bitangent = cross(n, tangent);
+    
+    vec3 sum = vec3(0.0f);
+    float weight = 0.0f;
+    for(int i = 0; i < PHI_STEPS; i++) {
+        float phi = 2.0f * PI * (float(i) + 0.5f) / float(PHI_STEPS);
+        for(int j = 0; j < THETA_STEPS; j++) {
+            float theta = 0.5f * PI * (float(j) + 0.5f) / float(THETA_STEPS);
+            vec3 dir = cos(theta) * n + sin(theta) * (cos(phi) * tangent + sin(phi) * bitangent);
+            
+            float w = cos(theta) * sin(theta); // the cosine lobe times the solid angle of the step
+            sum += textureLod(radiance, dir, radiance_lod).rgb * w;
+            weight += w;
+        }
+    }
+    
+    fragColor = vec4(sum / weight, 1.0f);
+}
@@ -0,0 +1,165 @@
+//
+//  simulation.h
+//  Clouds
+//
+//  Fixed-timestep update thread. The GLFW callbacks (main thread) only record the input, the update
+//  thread moves the camera and the light and publishes an immutable snapshot of every tick for the renderer.
+//
+
+#ifndef simulation_h
+#define simulation_h
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cmath>
+
+#include "glm.hpp"
+
+#include "camera.h"
+#include "triple_buffer.h"
+
+#define SIMULATION_TICK_RATE 120 // ticks per second
+#define LIGHT_ANGULAR_SPEED 0.2f // radians per second
+
+// everything the renderer needs from one tick
+struct FrameSnapshot {
+    Camera camera;
+    double time = 0.0; // simulation time, advances by exactly one tick per snapshot
+    unsigned long tick = 0;
+    float light_angle = 1.0427f;
+};
+
+// keys held down, recorded on the main thread
+enum InputKey {
+    INPUT_FORWARD = 1 << 0,
+    INPUT_BACK = 1 << 1,
+    INPUT_LEFT = 1 << 2,
+    INPUT_RIGHT = 1 << 3,
+    INPUT_FAST = 1 << 4,
+    INPUT_SLOW = 1 << 5,
+    INPUT_LIGHT_UP = 1 << 6,
+    INPUT_LIGHT_DOWN = 1 << 7
+};
+
+class Simulation {
+private:
+    // input shared with the main thread
+    std::atomic<unsigned int> keys;
+    std::atomic<float> aspect;
+    std::mutex mouse_mutex;
+    float mouse_x = 0.0f, mouse_y = 0.0f, scroll = 0.0f; // accumulated since the last tick
+
+    // state owned by the update thread
+    FrameSnapshot state;
+
+    TripleBuffer<FrameSnapshot> snapshots;
+    std::atomic<bool> running;
+    std::thread thread;
+
+    void tick(float dt) {
+        unsigned int held = keys.load(std::memory_order_relaxed);
+        Camera& camera = state.camera;
+
+        float new_aspect = aspect.load(std::memory_order_relaxed);
+        if(new_aspect > 0.0f) {
+            camera.setSize(new_aspect);
+            aspect.store(0.0f, std::memory_order_relaxed);
+        }
+
+        float dx, dy, ds;
+        {
+            std::lock_guard<std::mutex> lock(mouse_mutex);
+            dx = mouse_x;
+            dy = mouse_y;
+            ds = scroll;
+            mouse_x = mouse_y = scroll = 0.0f;
+        }
+        if(dx != 0.0f || dy != 0.0f) camera.rotate(dx, dy);
+        if(ds != 0.0f) camera.zoom(ds);
+
+        if(held & INPUT_FAST) camera.setFasterSpeed(true);
+        else if(held & INPUT_SLOW) camera.setSlowerSpeed(true);
+        else camera.setFasterSpeed(false);
+
+        if(held & INPUT_FORWARD) camera.move(FORWARD, dt);
+        if(held & INPUT_BACK) camera.move(BACK, dt);
+        if(held & INPUT_LEFT) camera.move(LEFT, dt);
+        if(held & INPUT_RIGHT) camera.move(RIGHT, dt);
+
+        if(held & INPUT_LIGHT_UP) state.light_angle += LIGHT_ANGULAR_SPEED * dt;
+        if(held & INPUT_LIGHT_DOWN) state.light_angle -= LIGHT_ANGULAR_SPEED * dt;
+        state.light_angle = glm::clamp(state.light_angle, 0.0f, float(M_PI));
+
+        state.tick++;
+        state.time = state.tick * double(dt);
+    }
+
+    void run() {
+        const std::chrono::nanoseconds tick_length(1000000000 / SIMULATION_TICK_RATE);
+        const float dt = 1.0f / SIMULATION_TICK_RATE;
+
+        auto next = std::chrono::steady_clock::now();
+        while(running.load(std::memory_order_relaxed)) {
+            tick(dt);
+            snapshots.write(state);
+
+            // catch up without sleeping if the thread was descheduled for a long time
+            next += tick_length;
+            auto now = std::chrono::steady_clock::now();
+            if(next < now - 10*tick_length) next = now;
+            std::this_thread::sleep_until(next);
+        }
+    }
+
+public:
+    Simulation(const Camera& camera) : keys(0), aspect(0.0f), running(false) {
+        state.camera = camera;
+        snapshots.write(state);
+    }
+
+    ~Simulation() {
+        stop();
+    }
+
+    Simulation(const Simulation&) = delete;
+    Simulation& operator=(const Simulation&) = delete;
+
+    void start() {
+        if(running.exchange(true)) return;
+        thread = std::thread(&Simulation::run, this);
+    }
+
+    void stop() {
+        if(!running.exchange(false)) return;
+        thread.join();
+    }
+
+    // called by the render thread
+    const FrameSnapshot& latest() {
+        return snapshots.read();
+    }
+
+    // called from the main thread
+    void setKeys(unsigned int held) {
+        keys.store(held, std::memory_order_relaxed);
+    }
+
+    void setAspect(float new_aspect) {
+        aspect.store(new_aspect, std::memory_order_relaxed);
+    }
+
+    void addMouseMotion(float x, float y) {
+        std::lock_guard<std::mutex> lock(mouse_mutex);
+        mouse_x += x;
+        mouse_y += y;
+    }
+
+    void addScroll(float offset) {
+        std::lock_guard<std::mutex> lock(mouse_mutex);
+        scroll += offset;
+    }
+};
+
+#endif /* simulation_h */
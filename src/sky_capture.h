@@ -0,0 +1,236 @@
+//
+//  sky_capture.h
+//  Clouds
+//
+//  A small cubemap of the cloudscape seen from the camera, used by the object shaders for the ambient light
+//  and the reflections. One face is rendered with the cloud shader every frame, so the whole cube follows the
+//  camera and the clouds with a delay of six frames.
+//
+
+#ifndef sky_capture_h
+#define sky_capture_h
+
+#define SKY_CAPTURE_SIZE 64 // of a face of the radiance cubemap
+#define SKY_IRRADIANCE_SIZE 16 // of a face of the irradiance cubemap
+#define SKY_IRRADIANCE_LOD 3.0f // mip level of the radiance cubemap the irradiance is integrated from
+
+#include <GL/glew.h>
+#include "glm.hpp"
+
+#include "shader.h"
+#include "frame_uniforms.h"
+
+class SkyCapture {
+private:
+    Shader irradiance_shader;
+    GLint radiance_loc, radiance_lod_loc, face_llc_loc, face_horizontal_loc, face_vertical_loc;
+    GLint scene_texture_loc, scene_depth_loc; // of the cloud shader
+    GLuint FBO;
+    GLuint radiance_texture, irradiance_texture; // the mip levels of the radiance are blurred versions for the rough surfaces
+    GLuint empty_scene, empty_depth; // the capture has no objects in front of the clouds
+
+    float vertices[12];
+    unsigned int indices[6];
+    unsigned int VBO, VAO, EBO;
+
+    int next_face = 0;
+    bool captured = false; // all the faces were rendered at least once
+
+    // directions of the texel centres of a face, in the same form as the camera vectors of FrameData:
+    // dir = llc + s*horizontal + t*vertical, with s and t going over the face as the cubemap lookup maps them
+    static void faceVectors(int face, glm::vec3& llc, glm::vec3& horizontal, glm::vec3& vertical) {
+        const glm::vec3 forward[6] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+        const glm::vec3 right[6] = {{0, 0, -1}, {0, 0, 1}, {1, 0, 0}, {1, 0, 0}, {1, 0, 0}, {-1, 0, 0}};
+        const glm::vec3 up[6] = {{0, -1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}, {0, -1, 0}, {0, -1, 0}};
+
+        llc = forward[face] - right[face] - up[face];
+        horizontal = 2.0f * right[face];
+        vertical = 2.0f * up[face];
+    }
+
+    static void createCubemap(GLuint& texture, int size, bool mipmapped) {
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+        for(int face = 0; face < 6; face++) {
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_R11F_G11F_B10F, size, size, 0, GL_RGB, GL_FLOAT, NULL);
+        }
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        if(mipmapped) glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    }
+
+    static void createEmptyTexture(GLuint& texture, GLint internal_format, GLenum format, GLenum type, const void* value) {
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internal_format, 1, 1, 0, format, type, value);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    void locateIrradianceUniforms() {
+        radiance_loc = irradiance_shader.location("radiance");
+        radiance_lod_loc = irradiance_shader.location("radiance_lod");
+        face_llc_loc = irradiance_shader.location("face_llc");
+        face_horizontal_loc = irradiance_shader.location("face_horizontal");
+        face_vertical_loc = irradiance_shader.location("face_vertical");
+    }
+
+    void drawQuad() {
+        glBindVertexArray(VAO);
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    }
+
+    // render the clouds seen from the camera position into one face of the radiance cubemap
+    void renderRadiance(int face, FrameUniforms& frame, Shader& cloud_shader) {
+        FrameData camera_data = frame.data;
+        faceVectors(face, frame.data.camera_llc, frame.data.horizontal, frame.data.vertical);
+        frame.update();
+
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, radiance_texture, 0);
+        glViewport(0, 0, SKY_CAPTURE_SIZE, SKY_CAPTURE_SIZE);
+
+        cloud_shader.use();
+
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, empty_scene);
+        cloud_shader.setInt(scene_texture_loc, 1);
+
+        glActiveTexture(GL_TEXTURE4);
+        glBindTexture(GL_TEXTURE_2D, empty_depth);
+        cloud_shader.setInt(scene_depth_loc, 4);
+
+        drawQuad();
+
+        frame.data = camera_data;
+        frame.update();
+    }
+
+    // blur the radiance into its mip levels and integrate the face of the irradiance cubemap over the cosine lobe
+    void renderIrradiance(int face) {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, irradiance_texture, 0);
+        glViewport(0, 0, SKY_IRRADIANCE_SIZE, SKY_IRRADIANCE_SIZE);
+
+        glActiveTexture(GL_TEXTURE0 + SKY_RADIANCE_UNIT);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, radiance_texture);
+        glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+        glActiveTexture(GL_TEXTURE0);
+
+        glm::vec3 llc, horizontal, vertical;
+        faceVectors(face, llc, horizontal, vertical);
+
+        irradiance_shader.use();
+        irradiance_shader.setInt(radiance_loc, SKY_RADIANCE_UNIT);
+        irradiance_shader.setFloat(radiance_lod_loc, SKY_IRRADIANCE_LOD);
+        irradiance_shader.setVec3(face_llc_loc, llc);
+        irradiance_shader.setVec3(face_horizontal_loc, horizontal);
+        irradiance_shader.setVec3(face_vertical_loc, vertical);
+
+        drawQuad();
+    }
+
+public:
+    SkyCapture(const char* vertex_path, const char* irradiance_path, Shader& cloud_shader) : vertices {
+        1.0f,  1.0f, 0.0f,  // top right
+        1.0f, -1.0f, 0.0f,  // bottom right
+        -1.0f, -1.0f, 0.0f,  // bottom left
+        -1.0f,  1.0f, 0.0f   // top left
+    }, indices {
+        0, 1, 3,
+        1, 2, 3
+    }, irradiance_shader(vertex_path, irradiance_path) {
+        glGenVertexArrays(1, &VAO);
+        glGenBuffers(1, &VBO);
+        glGenBuffers(1, &EBO);
+
+        glBindVertexArray(VAO);
+
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(0);
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+
+        // the blurred mip levels are filtered across the edges of the faces
+        glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+        createCubemap(radiance_texture, SKY_CAPTURE_SIZE, true);
+        createCubemap(irradiance_texture, SKY_IRRADIANCE_SIZE, false);
+
+        // depth 1.0 is the background for the cloud shader
+        const float black[3] = {0.0f, 0.0f, 0.0f}, far_depth = 1.0f;
+        createEmptyTexture(empty_scene, GL_R11F_G11F_B10F, GL_RGB, GL_FLOAT, black);
+        createEmptyTexture(empty_depth, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_FLOAT, &far_depth);
+
+        glGenFramebuffers(1, &FBO);
+
+        locateIrradianceUniforms();
+        locateUniforms(cloud_shader);
+    }
+
+    ~SkyCapture() {
+        glDeleteVertexArrays(1, &VAO);
+        glDeleteBuffers(1, &VBO);
+        glDeleteBuffers(1, &EBO);
+
+        glDeleteFramebuffers(1, &FBO);
+        glDeleteTextures(1, &radiance_texture);
+        glDeleteTextures(1, &irradiance_texture);
+        glDeleteTextures(1, &empty_scene);
+        glDeleteTextures(1, &empty_depth);
+    }
+
+    SkyCapture(const SkyCapture&) = delete;
+    SkyCapture& operator=(const SkyCapture&) = delete;
+
+    // the cloud shader was relinked, so its uniform locations may have moved
+    void locateUniforms(Shader& cloud_shader) {
+        scene_texture_loc = cloud_shader.location("sceneTexture");
+        scene_depth_loc = cloud_shader.location("sceneDepth");
+    }
+
+    // reload the irradiance shader if the path belongs to it
+    bool reloadShaders(const std::string& path) {
+        if(!irradiance_shader.usesFile(path) || !irradiance_shader.reload()) return false;
+        locateIrradianceUniforms();
+        return true;
+    }
+
+    // render the next face - called after frame.update() and Clouds::transferData, which bind the cloud volumes
+    // the first call renders all the faces, so the cubemaps are never read uninitialised
+    void update(FrameUniforms& frame, Shader& cloud_shader) {
+        glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+
+        if(!captured) {
+            for(int face = 0; face < 6; face++) renderRadiance(face, frame, cloud_shader);
+            for(int face = 0; face < 6; face++) renderIrradiance(face);
+            captured = true;
+        } else {
+            renderRadiance(next_face, frame, cloud_shader);
+            renderIrradiance(next_face);
+            next_face = (next_face + 1) % 6;
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    // for the object shaders, see object.fs
+    void bind() {
+        glActiveTexture(GL_TEXTURE0 + SKY_RADIANCE_UNIT);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, radiance_texture);
+        glActiveTexture(GL_TEXTURE0 + SKY_IRRADIANCE_UNIT);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, irradiance_texture);
+        glActiveTexture(GL_TEXTURE0);
+    }
+};
+
+#endif /* sky_capture_h */
@@ -0,0 +1,166 @@
+//
+//  slab_scheduler.h
+//  Clouds
+//
+//  Splits the generation of a volume into z-slabs run on several OpenCL devices. Every device has its own
+//  context, queue and thread, and the thread takes the next free slab whenever it finishes one, so the
+//  faster devices end up with more of the volume.
+//
+
+#ifndef slab_scheduler_h
+#define slab_scheduler_h
+
+#define SLAB_DEPTH 8 // z-slices of a slab
+#define CPU_SUB_DEVICE_UNITS 4 // compute units of the sub-devices an extra CPU device is split into
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+
+#include "compute_device.h"
+
+struct SlabWorker {
+    int id = 0;
+    std::string name;
+    cl::Context context;
+    cl::Device device;
+    cl::CommandQueue queue;
+    std::map<std::string, cl::Program> programs; // kernel variants cached by their files and build options
+
+    int slabs = 0; // taken in the last run
+    double busy = 0.0; // ms spent on them
+
+    cl::Program& getProgram(const std::string& path, const std::string& code, const std::string& options) {
+        std::string key = path + "|" + options;
+        auto it = programs.find(key);
+        if(it != programs.end()) return it->second;
+
+        cl::Program::Sources sources;
+        sources.push_back({code.c_str(), code.length()});
+        cl::Program program(context, sources);
+
+        try {
+            program.build({device}, options.c_str());
+        } catch(cl::Error e) {
+            if(e.err() == CL_BUILD_PROGRAM_FAILURE) {
+                std::cerr << "ERROR: OpenCL: CANNOT BUILD " << path << " FOR " << name << " WITH OPTIONS:" << options << "\n" << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+            }
+            throw;
+        }
+
+        return programs.emplace(key, program).first->second;
+    }
+};
+
+class SlabScheduler {
+private:
+    std::vector<std::unique_ptr<SlabWorker>> workers;
+
+public:
+    void addWorker(const std::string& name, const cl::Context& context, const cl::Device& device, const cl::CommandQueue& queue) {
+        std::unique_ptr<SlabWorker> worker(new SlabWorker());
+        worker->id = int(workers.size());
+        worker->name = name;
+        worker->context = context;
+        worker->device = device;
+        worker->queue = queue;
+        workers.push_back(std::move(worker));
+    }
+
+    // a CPU runs a single NDRange on all of its cores, so it is split into sub-devices which take slabs on their own
+    void addDevice(const ComputeDevice& d) {
+        std::vector<cl::Device> devices = {d.device};
+
+        if((d.type & CL_DEVICE_TYPE_CPU) && d.compute_units >= 2*CPU_SUB_DEVICE_UNITS && d.device.getInfo<CL_DEVICE_PARTITION_MAX_SUB_DEVICES>() > 1) {
+            const cl_device_partition_property properties[] = {CL_DEVICE_PARTITION_EQUALLY, CPU_SUB_DEVICE_UNITS, 0};
+            std::vector<cl::Device> sub_devices;
+            try {
+                d.device.createSubDevices(properties, &sub_devices);
+                if(!sub_devices.empty()) devices = sub_devices;
+            } catch(cl::Error e) {
+                std::cerr << "ERROR: OpenCL: CANNOT SPLIT " << d.name << ": " << e.err() << ", USING THE WHOLE DEVICE" << std::endl;
+            }
+        }
+
+        for(size_t i = 0; i < devices.size(); i++) {
+            std::string name = devices.size() > 1 ? d.name + " #" + std::to_string(i) : d.name;
+            cl::Context context(devices[i]);
+            addWorker(name, context, devices[i], cl::CommandQueue(context, devices[i]));
+        }
+    }
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    // drop the programs built from a changed kernel file
+    void clearPrograms(const std::string& path) {
+        for(std::unique_ptr<SlabWorker>& worker : workers) {
+            for(auto it = worker->programs.begin(); it != worker->programs.end();) {
+                if(it->first.compare(0, path.length()+1, path + "|") == 0) it = worker->programs.erase(it);
+                else ++it;
+            }
+        }
+    }
+
+    // call job(worker, z, depth) for every slab of a volume with the given number of z-slices, using the first
+    // worker_count workers (0 - all of them) - returns the time of the whole run in ms
+    // the first exception thrown by a job stops the other workers and is rethrown here
+    double run(int slices, const std::function<void(SlabWorker&, int, int)>& job, size_t worker_count = 0) {
+        if(worker_count == 0 || worker_count > workers.size()) worker_count = workers.size();
+
+        std::atomic<int> next_slab(0);
+        std::atomic<bool> failed(false);
+        std::exception_ptr error;
+        int slab_count = (slices + SLAB_DEPTH - 1) / SLAB_DEPTH;
+
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> threads;
+        for(size_t i = 0; i < worker_count; i++) {
+            SlabWorker* worker = workers[i].get();
+            worker->slabs = 0;
+            worker->busy = 0.0;
+
+            threads.emplace_back([&, worker] {
+                try {
+                    for(int slab = next_slab++; slab < slab_count && !failed; slab = next_slab++) {
+                        auto slab_start = std::chrono::steady_clock::now();
+                        int z = slab * SLAB_DEPTH;
+                        job(*worker, z, std::min(SLAB_DEPTH, slices - z));
+                        worker->slabs++;
+                        worker->busy += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - slab_start).count();
+                    }
+                } catch(...) {
+                    if(!failed.exchange(true)) error = std::current_exception();
+                }
+            });
+        }
+        for(std::thread& thread : threads) thread.join();
+
+        if(error) std::rethrow_exception(error);
+
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // slabs and busy time of the workers of the last run, the utilisation is the busy time over worker_count times the run time
+    void report(double time, size_t worker_count = 0) const {
+        if(worker_count == 0 || worker_count > workers.size()) worker_count = workers.size();
+
+        double busy = 0.0;
+        for(size_t i = 0; i < worker_count; i++) {
+            std::cout << "OpenCL: SLABS: " << workers[i]->name << ": " << workers[i]->slabs << " slabs, " << workers[i]->busy << " ms" << std::endl;
+            busy += workers[i]->busy;
+        }
+        std::cout << "OpenCL: SLABS: " << worker_count << " devices: " << time << " ms, utilisation " << int(100.0 * busy / (worker_count * time)) << "%" << std::endl;
+    }
+};
+
+#endif /* slab_scheduler_h */
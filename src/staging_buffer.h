@@ -0,0 +1,131 @@
+//
+//  staging_buffer.h
+//  Clouds
+//
+//  Upload buffer for textures and vertex data. It is mapped persistently when ARB_buffer_storage
+//  is available, otherwise it is mapped for every upload (the GL 4.1 core profile has no persistent mapping).
+//  The uploads go round a ring of regions, so a new one only waits for the GL to finish the region it reuses.
+//
+
+#ifndef staging_buffer_h
+#define staging_buffer_h
+
+#define STAGING_REGIONS 3 // uploads in flight at once, each region of the buffer has its own fence
+#define STAGING_ALIGNMENT 256 // of the offsets of the regions
+
+#include <GL/glew.h>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+
+class StagingBuffer {
+private:
+    GLuint buffer = 0;
+    size_t region_size = 0;
+    void* persistent = nullptr;
+    GLsync fences[STAGING_REGIONS] = {};
+    int region = 0; // the one the next upload goes to
+
+    // the GL may still be reading an earlier upload from the region - a timeout only means the GPU is busy, so keep waiting
+    void waitForFence(int i) {
+        if(fences[i] == nullptr) return;
+        GLenum result = glClientWaitSync(fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(1000000000));
+        while(result == GL_TIMEOUT_EXPIRED) result = glClientWaitSync(fences[i], 0, GLuint64(1000000000));
+        if(result == GL_WAIT_FAILED) std::cerr << "ERROR: STAGING BUFFER: FENCE WAIT FAILED" << std::endl;
+        glDeleteSync(fences[i]);
+        fences[i] = nullptr;
+    }
+
+    void waitForAll() {
+        for(int i = 0; i < STAGING_REGIONS; i++) waitForFence(i);
+    }
+
+    void unmap() {
+        if(buffer == 0) return;
+        if(persistent != nullptr) {
+            glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+            glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+            persistent = nullptr;
+        }
+        glDeleteBuffers(1, &buffer);
+        buffer = 0;
+    }
+
+    // every region has to hold the upload, a larger one reallocates the buffer once the GL is done with all of them
+    void reserve(size_t bytes) {
+        if(bytes <= region_size) return;
+        waitForAll();
+        unmap();
+
+        region_size = std::max(bytes, region_size * 2);
+        region_size = (region_size + STAGING_ALIGNMENT - 1) / STAGING_ALIGNMENT * STAGING_ALIGNMENT;
+        size_t capacity = region_size * STAGING_REGIONS;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        if(GLEW_ARB_buffer_storage) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_COPY_WRITE_BUFFER, capacity, NULL, flags);
+            persistent = glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, capacity, flags);
+        } else {
+            glBufferData(GL_COPY_WRITE_BUFFER, capacity, NULL, GL_STREAM_DRAW);
+            persistent = nullptr;
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    // copy the data into the next region of the buffer, leave the buffer bound to the target and return the offset of the region
+    // only that region is waited for, so the copy overlaps the GL reading the uploads before it
+    size_t stage(GLenum target, const void* data, size_t bytes) {
+        reserve(bytes);
+        waitForFence(region);
+        size_t offset = size_t(region) * region_size;
+
+        glBindBuffer(target, buffer);
+        if(persistent != nullptr) {
+            std::memcpy((char*)persistent + offset, data, bytes);
+        } else {
+            // the fence already says the GL is done with the region
+            void* mapped = glMapBufferRange(target, offset, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+            std::memcpy(mapped, data, bytes);
+            glUnmapBuffer(target);
+        }
+        return offset;
+    }
+
+    void release(GLenum target) {
+        glBindBuffer(target, 0);
+        fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        region = (region + 1) % STAGING_REGIONS;
+    }
+
+public:
+    StagingBuffer() {}
+
+    ~StagingBuffer() {
+        waitForAll();
+        unmap();
+    }
+
+    StagingBuffer(const StagingBuffer&) = delete;
+    StagingBuffer& operator=(const StagingBuffer&) = delete;
+
+    // upload tightly packed pixels to the bound 2D texture
+    void texImage2D(GLint internal_format, int width, int height, GLenum format, const void* pixels, size_t bytes) {
+        size_t offset = stage(GL_PIXEL_UNPACK_BUFFER, pixels, bytes);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, GL_UNSIGNED_BYTE, (void*)offset);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        release(GL_PIXEL_UNPACK_BUFFER);
+    }
+
+    // allocate the buffer bound to the target and fill it on the GPU side
+    void bufferData(GLenum target, const void* data, size_t bytes) {
+        glBufferData(target, bytes, NULL, GL_STATIC_DRAW);
+        size_t offset = stage(GL_COPY_READ_BUFFER, data, bytes);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, target, GLintptr(offset), 0, bytes);
+        release(GL_COPY_READ_BUFFER);
+    }
+};
+
+#endif /* staging_buffer_h */
@@ -0,0 +1,94 @@
+//
+//  thread_pool.h
+//  Clouds
+//
+//  Fixed pool of worker threads for the CPU side of asset loading.
+//
+
+#ifndef thread_pool_h
+#define thread_pool_h
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <vector>
+#include <algorithm>
+
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping = false;
+
+    void work() {
+        while(true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if(stopping && tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+
+public:
+    // by default one hardware thread is left for the GL thread
+    ThreadPool(unsigned int thread_count = 0) {
+        if(thread_count == 0) thread_count = std::max(2u, std::thread::hardware_concurrency()) - 1;
+        for(unsigned int i = 0; i < thread_count; i++) workers.emplace_back(&ThreadPool::work, this);
+    }
+
+    // the queued tasks are finished before the threads are joined
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_all();
+        for(std::thread& worker : workers) worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    // tasks must not wait for other tasks of the pool, the result is collected through the future
+    template<class F>
+    auto submit(F task) -> std::future<decltype(task())> {
+        auto packaged = std::make_shared<std::packaged_task<decltype(task())()>>(std::move(task));
+        std::future<decltype(task())> result = packaged->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.emplace([packaged] { (*packaged)(); });
+        }
+        condition.notify_one();
+        return result;
+    }
+};
+
+// runs the task on the pool, or defers it until the result is needed if there is no pool
+template<class F>
+auto runTask(ThreadPool* pool, F task) -> std::future<decltype(task())> {
+    if(pool != nullptr) return pool->submit(std::move(task));
+    return std::async(std::launch::deferred, std::move(task));
+}
+
+// with wait set the result is always available - get() blocks (or runs a deferred task)
+template<class T>
+bool futureReady(const std::future<T>& future, bool wait) {
+    return wait || future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+#endif /* thread_pool_h */
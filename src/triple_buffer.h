@@ -0,0 +1,56 @@
+//
+//  triple_buffer.h
+//  Clouds
+//
+//  Lock-free single producer, single consumer triple buffer. The writer never waits for the reader
+//  and the reader always gets the most recent complete value.
+//
+
+#ifndef triple_buffer_h
+#define triple_buffer_h
+
+#include <atomic>
+
+template<class T>
+class TripleBuffer {
+private:
+    static const int INDEX_MASK = 3;
+    static const int FRESH_BIT = 4; // the shared slot holds a value the reader has not taken yet
+
+    T buffers[3];
+    std::atomic<int> shared;
+    int write_index = 0; // owned by the writer
+    int read_index = 2;  // owned by the reader
+
+public:
+    TripleBuffer() : shared(1) {}
+
+    // the writer fills this buffer and then calls publish()
+    T& writeBuffer() {
+        return buffers[write_index];
+    }
+
+    // swap the written buffer with the shared one
+    void publish() {
+        write_index = shared.exchange(write_index | FRESH_BIT, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    void write(const T& value) {
+        buffers[write_index] = value;
+        publish();
+    }
+
+    // the latest published value - the same one again if nothing new was published
+    const T& read() {
+        if(shared.load(std::memory_order_relaxed) & FRESH_BIT) {
+            read_index = shared.exchange(read_index, std::memory_order_acq_rel) & INDEX_MASK;
+        }
+        return buffers[read_index];
+    }
+
+    bool fresh() const {
+        return (shared.load(std::memory_order_relaxed) & FRESH_BIT) != 0;
+    }
+};
+
+#endif /* triple_buffer_h */